@@ -18,6 +18,7 @@ SOURCES = \
   src/qr/LoopFormationExtruder.cpp \
   src/qr/LoopFormationConstructor.cpp \
   src/qr/ObjectConstructor.cpp \
+  src/qr/CarveLock.cpp \
   src/qr/VertexClassifier.cpp \
   src/qr/ViewConstructor.cpp \
   src/qr/ViewGlView.cpp \
@@ -0,0 +1,15 @@
+#include "CarveLock.h"
+
+namespace qr {
+  namespace {
+    QMutex carveMutex;
+  } // namespace
+
+// -------------------------------------------------------------------------- //
+// CarveLock
+// -------------------------------------------------------------------------- //
+  QMutex* CarveLock::mutex() {
+    return &carveMutex;
+  }
+
+} // namespace qr
@@ -0,0 +1,37 @@
+#ifndef __QR_CARVE_LOCK_H__
+#define __QR_CARVE_LOCK_H__
+
+#include "config.h"
+#include <boost/noncopyable.hpp>
+#include <QMutex>
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// CarveLock
+// -------------------------------------------------------------------------- //
+  /**
+   * Scoped lock that serializes all calls into carve.
+   *
+   * carve 1.x marks visited vertices, edges and faces with a generation
+   * counter that is a static member of carve::tagable, shared by the whole
+   * process. Evaluation of CSG trees, canonicalization, construction, copying
+   * and transformation of polyhedrons therefore must not run concurrently.
+   * Locks are not recursive, so no carve lock may be held while calling code
+   * that takes one, e.g. PrimitiveCache or LoopExtrusionCache. */
+  class CarveLock: private boost::noncopyable {
+  public:
+    CarveLock() {
+      mutex()->lock();
+    }
+
+    ~CarveLock() {
+      mutex()->unlock();
+    }
+
+  private:
+    static QMutex* mutex();
+  };
+
+} // namespace qr
+
+#endif // __QR_CARVE_LOCK_H__
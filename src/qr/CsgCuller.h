@@ -0,0 +1,110 @@
+#ifndef __QR_CSG_CULLER_H__
+#define __QR_CSG_CULLER_H__
+
+#include "config.h"
+#include <boost/noncopyable.hpp>
+#include <boost/foreach.hpp>
+#include <QList>
+#include <QAtomicInt>
+#include <carve/poly.hpp>
+#include "GRect.h"
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// CsgCuller
+// -------------------------------------------------------------------------- //
+  /**
+   * CsgCuller resolves boolean operations on polyhedrons by their bounding
+   * boxes without evaluating them, and counts the operations it has skipped
+   * this way.
+   *
+   * Disjoint bounding boxes imply disjoint solids. Containment of bounding
+   * boxes does not imply containment of the solids, unless the containing
+   * solid is a box itself. */
+  class CsgCuller: private boost::noncopyable {
+  public:
+    CsgCuller(): mSkipped(0) {}
+
+    /** @returns                       Bounding box of the given polyhedron. */
+    static Rect3d boundingRect(const carve::poly::Polyhedron* poly) {
+      Rect3d result;
+      for(std::size_t i = 0; i < poly->vertices.size(); i++) {
+        const carve::geom::vector<3>& v = poly->vertices[i].v;
+        result.extend(Vector3d(v.x, v.y, v.z));
+      }
+      return result;
+    }
+
+    /** @returns                       True if the given boxes do not even touch. */
+    static bool isDisjoint(const Rect3d& a, const Rect3d& b) {
+      return a.isEmpty() || b.isEmpty() || !a.intersects(b, 0.0);
+    }
+
+    /**
+     * @returns                        True if the given box contains the other one. If a solid is exactly
+     *                                 the first box, then its intersection with any solid inside the
+     *                                 second box is that other solid. */
+    static bool contains(const Rect3d& box, const Rect3d& rect) {
+      return !box.isEmpty() && !rect.isEmpty() && box.contains(rect, 0.0);
+    }
+
+    /**
+     * @returns                        True if the given polyhedron is exactly its bounding box, i.e. each
+     *                                 of its faces lies in a face plane of the bounding box. */
+    static bool isBox(const carve::poly::Polyhedron* poly) {
+      Rect3d rect = boundingRect(poly);
+      for(int axis = 0; axis < 3; axis++)
+        if(!(rect.min(axis) < rect.max(axis)))
+          return false;
+
+      for(std::size_t i = 0; i < poly->faces.size(); i++) {
+        const carve::poly::Face<3>& face = poly->faces[i];
+
+        bool isOnPlane = false;
+        for(int axis = 0; axis < 3 && !isOnPlane; axis++) {
+          bool isOnMin = true, isOnMax = true;
+          for(std::size_t j = 0; j < face.vertices.size(); j++) {
+            isOnMin = isOnMin && face.vertices[j]->v.v[axis] == rect.min(axis);
+            isOnMax = isOnMax && face.vertices[j]->v.v[axis] == rect.max(axis);
+          }
+          isOnPlane = isOnMin || isOnMax;
+        }
+        if(!isOnPlane)
+          return false;
+      }
+      return !poly->faces.empty();
+    }
+
+    /**
+     * Removes polyhedrons that are disjoint from the given bounding box from
+     * the list, as subtracting them from a solid inside this box is an
+     * identity. Removed polyhedrons are deleted. */
+    void cullSubtractions(const Rect3d& rect, QList<carve::poly::Polyhedron*>& subtractions) {
+      QList<carve::poly::Polyhedron*> result;
+      foreach(carve::poly::Polyhedron* subtraction, subtractions) {
+        if(subtraction != NULL && isDisjoint(rect, boundingRect(subtraction))) {
+          delete subtraction;
+          skip();
+        } else {
+          result.push_back(subtraction);
+        }
+      }
+      subtractions = result;
+    }
+
+    void skip(int count = 1) {
+      mSkipped.fetchAndAddOrdered(count);
+    }
+
+    /** @returns                       Number of skipped operations. */
+    int skipped() const {
+      return mSkipped;
+    }
+
+  private:
+    QAtomicInt mSkipped;
+  };
+
+} // namespace qr
+
+#endif // __QR_CSG_CULLER_H__
@@ -58,6 +58,60 @@ namespace qr {
         double angle = mStartAngle + pos * mSpanAngle;
         return mCenter + mLongAxis * cos(angle) + mShortAxis * sin(angle);
       }
+
+      /**
+       * Evaluates the arc at segmentCount + 1 evenly spaced positions, 
+       * i-th point being point(i / segmentCount).
+       *
+       * Only one sine and cosine pair is computed for the whole batch, the rest
+       * of the points are obtained by rotating the previous one.
+       *
+       * @param segmentCount           Number of segments to split the arc into.
+       * @param output                 Buffer for segmentCount + 1 points. */
+      void points(int segmentCount, Vector2d* output) const {
+        assert(segmentCount > 0);
+
+        double stepAngle = mSpanAngle / segmentCount;
+        double stepCos = cos(stepAngle), stepSin = sin(stepAngle);
+        double c = cos(mStartAngle), s = sin(mStartAngle);
+        for(int i = 0; i < segmentCount; i++) {
+          output[i] = mCenter + mLongAxis * c + mShortAxis * s;
+          double nextC = c * stepCos - s * stepSin;
+          s = s * stepCos + c * stepSin;
+          c = nextC;
+        }
+        
+        /* Last point must match the edge end exactly. */
+        output[segmentCount] = mCenter + mLongAxis * cos(endAngle()) + mShortAxis * sin(endAngle());
+      }
+
+      /** @returns                     Unit tangent at the given position, pointing towards increasing positions. */
+      Vector2d tangent(double pos) const {
+        double angle = mStartAngle + pos * mSpanAngle;
+        return (mShortAxis * cos(angle) - mLongAxis * sin(angle)).normalized();
+      }
+
+      Rect2d boundingRect() const {
+        Rect2d result;
+        result.extend(point(0.0));
+        result.extend(point(1.0));
+
+        /* Along axis k the arc is longAxis[k] * cos(a) + shortAxis[k] * sin(a), 
+         * which has its extrema at atan2(shortAxis[k], longAxis[k]) + {0, PI}. */
+        for(int k = 0; k < 2; k++) {
+          double extremumAngle = atan2(mShortAxis[k], mLongAxis[k]);
+          for(int i = 0; i < 2; i++) {
+            double delta = extremumAngle + i * M_PI - mStartAngle;
+            while(delta < 0)
+              delta += 2 * M_PI;
+            while(delta >= 2 * M_PI)
+              delta -= 2 * M_PI;
+            if(delta <= mSpanAngle)
+              result.extend(mCenter + mLongAxis * cos(mStartAngle + delta) + mShortAxis * sin(mStartAngle + delta));
+          }
+        }
+        return result;
+      }
       
       double startAngle() const {
         return mStartAngle;
@@ -188,8 +242,7 @@ namespace qr {
       if(mType == LINE) {
         return mSegment.asLine().direction().normalized();
       } else if(mType == ARC) {
-        const ArcData& arc = asArc();
-        return (arc.point(pos + 0.000001) - arc.point(pos - 0.000001)).normalized();
+        return asArc().tangent(pos);
       } else {
         Unreachable();
       }
@@ -283,7 +336,8 @@ namespace qr {
     }
 
     Rect2d boundingRect() const {
-      /* TODO for arcs? */
+      if(mType == ARC)
+        return asArc().boundingRect();
       return mSegment.boundingRect();
     }
 
@@ -2,77 +2,279 @@
 #define __QR_EVIDENCE_SET_H__
 
 #include "config.h"
-#include <set>
-#include <map>
-#include <algorithm> /* for std::set_intersection */
-#include <iterator> /* for std::inserter */
+#include <cassert>
+#include <vector>
+#include <algorithm> /* for std::swap(), std::max() */
+#include <boost/foreach.hpp>
+#include <QtGlobal>
+#include <QList>
 
 namespace qr {
+// -------------------------------------------------------------------------- //
+// ElementSet
+// -------------------------------------------------------------------------- //
+  /**
+   * ElementSet is a subset of a frame of discernment {0, ..., size - 1},
+   * stored as a dense bitset. */
+  class ElementSet {
+  public:
+    ElementSet(int size): mSize(size), mWords(wordCount(size), 0) {}
+
+    static ElementSet everything(int size) {
+      ElementSet result(size);
+      for(int i = 0; i < size; i++)
+        result.insert(i);
+      return result;
+    }
+
+    static ElementSet singleton(int size, int element) {
+      ElementSet result(size);
+      result.insert(element);
+      return result;
+    }
+
+    /** @returns                       Number of words in a bitset of the given size, never zero so that words() is always valid. */
+    static int wordCount(int size) {
+      return std::max(1, (size + 63) / 64);
+    }
+
+    int size() const {
+      return mSize;
+    }
+
+    void insert(int element) {
+      assert(element >= 0 && element < mSize);
+
+      mWords[element / 64] |= Q_UINT64_C(1) << (element % 64);
+    }
+
+    bool contains(int element) const {
+      assert(element >= 0 && element < mSize);
+
+      return (mWords[element / 64] >> (element % 64)) & 1;
+    }
+
+    const quint64* words() const {
+      return &mWords[0];
+    }
+
+  private:
+    int mSize;
+    std::vector<quint64> mWords;
+  };
+
+
 // -------------------------------------------------------------------------- //
 // EvidenceSet
 // -------------------------------------------------------------------------- //
-  template<class T>
+  /**
+   * EvidenceSet is a Dempster-Shafer mass function over a frame of discernment
+   * {0, ..., size - 1}.
+   *
+   * Focal elements are dense bitsets stored back to back in a single array,
+   * and are looked up through an open-addressing hash table keyed by their
+   * hashes. Elements with no mass are never stored. */
   class EvidenceSet {
-    typedef std::map<std::set<T>, double> container_type;
-    typedef typename container_type::iterator iterator;
-    typedef typename container_type::const_iterator const_iterator;
-    typedef typename container_type::value_type value_type;
   public:
-    EvidenceSet() {
-      mEvidence[std::set<T>()] = 0;
+    /** Simple support function, puts weight on focus and 1 - weight on the whole frame. */
+    struct SimpleSupport {
+      SimpleSupport(const ElementSet& focus, double weight): focus(focus), weight(weight) {}
+
+      ElementSet focus;
+      double weight;
+    };
+
+    EvidenceSet(int size): mSize(size), mWordCount(ElementSet::wordCount(size)), mSlots(16, -1) {}
+
+    int size() const {
+      return mSize;
     }
 
-    void addEvidence(const std::set<T>& set, double evidence) {
-      assert(mEvidence.find(set) == mEvidence.end());
+    void addEvidence(const ElementSet& set, double evidence) {
+      assert(set.size() == mSize);
 
-      mEvidence[set] = evidence;
+      add(set.words(), evidence);
     }
 
-    void combine(EvidenceSet& other) {
-      std::map<std::set<T>, double> newEvidence;
-      foreach(const value_type& pair, mEvidence)
-        newEvidence[pair.first] = 0;
-      foreach(const value_type& pair, other.mEvidence)
-        newEvidence[pair.first] = 0;
-      foreach(const value_type& aPair, mEvidence)
-        foreach(const value_type& bPair, other.mEvidence)
-          newEvidence[intersect(aPair.first, bPair.first)] = 0;
+    /** Combines this mass function with the given one using Dempster's rule. */
+    void combine(const EvidenceSet& other) {
+      assert(other.mSize == mSize);
 
+      EvidenceSet result(mSize);
+      std::vector<quint64> intersection(mWordCount);
       double k = 0;
-      foreach(const value_type& aPair, mEvidence)
-        foreach(const value_type& bPair, other.mEvidence)
-          if(intersect(aPair.first, bPair.first).empty())
-            k += mEvidence[aPair.first] * other.mEvidence[bPair.first];
-
-      foreach(const value_type& pair, newEvidence) {
-        double sum = 0;
-        if(!pair.first.empty())
-          foreach(const value_type& aPair, mEvidence)
-            foreach(const value_type& bPair, other.mEvidence)
-              if(intersect(aPair.first, bPair.first) == pair.first)
-                sum += mEvidence[aPair.first] * other.mEvidence[bPair.first];
-        newEvidence[pair.first] = 1 / (1 - k) * sum;
+      for(int a = 0; a < focalCount(); a++) {
+        for(int b = 0; b < other.focalCount(); b++) {
+          double mass = mMasses[a] * other.mMasses[b];
+          if(!intersect(focal(a), other.focal(b), &intersection[0]))
+            k += mass;
+          else
+            result.add(&intersection[0], mass);
+        }
       }
 
-      mEvidence = newEvidence;
+      result.normalize(k);
+      swap(result);
     }
 
-    double evidence(const std::set<T>& set) const {
-      const_iterator pos = mEvidence.find(set);
-      if(pos == mEvidence.end())
+    /**
+     * Combines this mass function with all of the given simple support
+     * functions.
+     *
+     * Functions with the same focus are merged first. Then each distinct
+     * focus is combined in place in a single pass over the focal elements,
+     * since a simple support function only has two focal elements. */
+    void combine(const QList<SimpleSupport>& functions) {
+      /* Merged weight of functions with focus F is 1 - prod(1 - w), track the product. */
+      EvidenceSet foci(mSize);
+      foreach(const SimpleSupport& function, functions) {
+        assert(function.focus.size() == mSize);
+
+        const quint64* words = function.focus.words();
+        quint64 h = hash(words);
+        int index = foci.find(words, h);
+        if(index < 0)
+          foci.insert(words, h, 1 - function.weight);
+        else
+          foci.mMasses[foci.mSlots[index]] *= 1 - function.weight;
+      }
+
+      std::vector<quint64> intersection(mWordCount);
+      std::vector<double> masses;
+      for(int f = 0; f < foci.focalCount(); f++) {
+        double weight = 1 - foci.mMasses[f];
+
+        masses = mMasses;
+        int count = focalCount();
+        for(int a = 0; a < count; a++)
+          mMasses[a] *= 1 - weight;
+
+        double k = 0;
+        for(int a = 0; a < count; a++) {
+          double mass = masses[a] * weight;
+          if(!intersect(focal(a), foci.focal(f), &intersection[0]))
+            k += mass;
+          else
+            add(&intersection[0], mass);
+        }
+        normalize(k);
+      }
+    }
+
+    double evidence(const ElementSet& set) const {
+      assert(set.size() == mSize);
+
+      int index = find(set.words(), hash(set.words()));
+      if(index < 0)
         return 0;
       else
-        return pos->second;
+        return mMasses[mSlots[index]];
     }
 
   private:
-    static std::set<T> intersect(const std::set<T>& a, const std::set<T>& b) {
-      std::set<T> result;
-      set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(result, result.end()));
+    int focalCount() const {
+      return static_cast<int>(mMasses.size());
+    }
+
+    const quint64* focal(int index) const {
+      return &mWords[index * mWordCount];
+    }
+
+    /** @returns                       False if the intersection is empty. */
+    bool intersect(const quint64* a, const quint64* b, quint64* result) const {
+      quint64 any = 0;
+      for(int i = 0; i < mWordCount; i++) {
+        result[i] = a[i] & b[i];
+        any |= result[i];
+      }
+      return any != 0;
+    }
+
+    quint64 hash(const quint64* words) const {
+      quint64 result = 0;
+      for(int i = 0; i < mWordCount; i++) {
+        quint64 x = result ^ words[i];
+        x += Q_UINT64_C(0x9E3779B97F4A7C15);
+        x = (x ^ (x >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+        x = (x ^ (x >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+        result = x ^ (x >> 31);
+      }
       return result;
     }
 
-    container_type mEvidence;
+    bool equals(const quint64* a, const quint64* b) const {
+      for(int i = 0; i < mWordCount; i++)
+        if(a[i] != b[i])
+          return false;
+      return true;
+    }
+
+    /** @returns                       Slot of the given focal element, or -(s + 1) where s is the free slot where it belongs. */
+    int find(const quint64* words, quint64 h) const {
+      int mask = static_cast<int>(mSlots.size()) - 1;
+      for(int slot = static_cast<int>(h & mask);; slot = (slot + 1) & mask) {
+        int index = mSlots[slot];
+        if(index < 0)
+          return -slot - 1;
+        if(mHashes[index] == h && equals(focal(index), words))
+          return slot;
+      }
+    }
+
+    void insert(const quint64* words, quint64 h, double mass) {
+      int slot = find(words, h);
+      assert(slot < 0);
+
+      mSlots[-slot - 1] = focalCount();
+      mWords.insert(mWords.end(), words, words + mWordCount);
+      mHashes.push_back(h);
+      mMasses.push_back(mass);
+
+      if(focalCount() * 2 > static_cast<int>(mSlots.size()))
+        rehash();
+    }
+
+    void add(const quint64* words, double mass) {
+      quint64 h = hash(words);
+      int slot = find(words, h);
+      if(slot >= 0)
+        mMasses[mSlots[slot]] += mass;
+      else
+        insert(words, h, mass);
+    }
+
+    void normalize(double k) {
+      double factor = 1 / (1 - k);
+      for(int i = 0; i < focalCount(); i++)
+        mMasses[i] *= factor;
+    }
+
+    void rehash() {
+      mSlots.assign(mSlots.size() * 2, -1);
+      int mask = static_cast<int>(mSlots.size()) - 1;
+      for(int index = 0; index < focalCount(); index++) {
+        int slot = static_cast<int>(mHashes[index] & mask);
+        while(mSlots[slot] >= 0)
+          slot = (slot + 1) & mask;
+        mSlots[slot] = index;
+      }
+    }
+
+    void swap(EvidenceSet& other) {
+      std::swap(mSize, other.mSize);
+      std::swap(mWordCount, other.mWordCount);
+      mSlots.swap(other.mSlots);
+      mWords.swap(other.mWords);
+      mHashes.swap(other.mHashes);
+      mMasses.swap(other.mMasses);
+    }
+
+    int mSize;
+    int mWordCount;
+    std::vector<int> mSlots;
+    std::vector<quint64> mWords;
+    std::vector<quint64> mHashes;
+    std::vector<double> mMasses;
   };
 
 } // namespace qr
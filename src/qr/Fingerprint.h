@@ -0,0 +1,199 @@
+#ifndef __QR_FINGERPRINT_H__
+#define __QR_FINGERPRINT_H__
+
+#include "config.h"
+#include <cassert>
+#include <vector>
+#include <QtGlobal>
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// Fingerprint
+// -------------------------------------------------------------------------- //
+  /**
+   * Fingerprint is an order-independent 128-bit hash of a set of primitives.
+   *
+   * Each element is hashed separately and the hashes are combined with
+   * commutative operations, so the fingerprint of a set does not depend on
+   * the order its elements are added in. */
+  class Fingerprint {
+  public:
+    Fingerprint(): mSum(0), mXor(0), mSize(0) {}
+
+    void add(const void* element) {
+      quint64 hash = mix(static_cast<quint64>(reinterpret_cast<quintptr>(element)));
+      mSum += hash;
+      mXor ^= mix(hash);
+      mSize++;
+    }
+
+    int size() const {
+      return mSize;
+    }
+
+    quint64 hash() const {
+      return mSum ^ (mXor >> 1) ^ static_cast<quint64>(mSize);
+    }
+
+    bool operator== (const Fingerprint& other) const {
+      return mSum == other.mSum && mXor == other.mXor && mSize == other.mSize;
+    }
+
+    bool operator!= (const Fingerprint& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    static quint64 mix(quint64 x) {
+      x += Q_UINT64_C(0x9E3779B97F4A7C15);
+      x = (x ^ (x >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+      x = (x ^ (x >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+      return x ^ (x >> 31);
+    }
+
+    quint64 mSum, mXor;
+    int mSize;
+  };
+
+
+// -------------------------------------------------------------------------- //
+// FingerprintSet
+// -------------------------------------------------------------------------- //
+  /**
+   * FingerprintSet is a set of sets of primitives.
+   *
+   * Sets are looked up by their fingerprints in an open-addressing hash table.
+   * Elements of all inserted sets are kept in a single flat array and are
+   * compared only when fingerprints match, so a lookup is O(k) hashing and
+   * does not allocate.
+   *
+   * Ranges passed in must not contain duplicate elements. Unlike std::set
+   * keys, they are not deduplicated, and the comparison relies on that. */
+  template<class T>
+  class FingerprintSet {
+  public:
+    FingerprintSet(): mSize(0) {
+      mSlots.resize(16, -1);
+    }
+
+    /** @returns                       True if the set formed by the given range is in this set. */
+    template<class Iterator>
+    bool contains(Iterator begin, Iterator end) const {
+      assert(isDuplicateFree(begin, end));
+
+      return find(fingerprint(begin, end), begin, end) >= 0;
+    }
+
+    /**
+     * Inserts the set formed by the given range.
+     *
+     * @returns                        True if the set was inserted, false if it was already there. */
+    template<class Iterator>
+    bool insert(Iterator begin, Iterator end) {
+      assert(isDuplicateFree(begin, end));
+
+      Fingerprint fingerprint = this->fingerprint(begin, end);
+      int slot = find(fingerprint, begin, end);
+      if(slot >= 0)
+        return false;
+
+      Entry entry;
+      entry.fingerprint = fingerprint;
+      entry.offset = static_cast<int>(mElements.size());
+      for(Iterator pos = begin; pos != end; ++pos)
+        mElements.push_back(*pos);
+      mEntries.push_back(entry);
+      mSlots[-slot - 1] = static_cast<int>(mEntries.size()) - 1;
+      mSize++;
+
+      if(mSize * 2 > static_cast<int>(mSlots.size()))
+        rehash();
+      return true;
+    }
+
+    int size() const {
+      return mSize;
+    }
+
+  private:
+    struct Entry {
+      Fingerprint fingerprint;
+      int offset;
+    };
+
+    template<class Iterator>
+    static Fingerprint fingerprint(Iterator begin, Iterator end) {
+      Fingerprint result;
+      for(Iterator pos = begin; pos != end; ++pos)
+        result.add(*pos);
+      return result;
+    }
+
+    /** @returns                       Slot of the matching set, or -(s + 1) where s is the free slot where it belongs. */
+    template<class Iterator>
+    int find(const Fingerprint& fingerprint, Iterator begin, Iterator end) const {
+      int mask = static_cast<int>(mSlots.size()) - 1;
+      for(int slot = static_cast<int>(fingerprint.hash() & mask);; slot = (slot + 1) & mask) {
+        int index = mSlots[slot];
+        if(index < 0)
+          return -slot - 1;
+
+        const Entry& entry = mEntries[index];
+        if(entry.fingerprint == fingerprint && equals(entry, begin, end))
+          return slot;
+      }
+    }
+
+    template<class Iterator>
+    static bool isDuplicateFree(Iterator begin, Iterator end) {
+      for(Iterator a = begin; a != end; ++a) {
+        Iterator b = a;
+        for(++b; b != end; ++b)
+          if(*a == *b)
+            return false;
+      }
+      return true;
+    }
+
+    /* Both sides are duplicate-free and of the same size, so one-sided inclusion is enough. */
+    template<class Iterator>
+    bool equals(const Entry& entry, Iterator begin, Iterator end) const {
+      int size = entry.fingerprint.size();
+      if(size == 0)
+        return true;
+
+      T* const* elements = &mElements[entry.offset];
+      for(Iterator pos = begin; pos != end; ++pos) {
+        bool found = false;
+        for(int i = 0; i < size; i++) {
+          if(elements[i] == *pos) {
+            found = true;
+            break;
+          }
+        }
+        if(!found)
+          return false;
+      }
+      return true;
+    }
+
+    void rehash() {
+      mSlots.assign(mSlots.size() * 2, -1);
+      int mask = static_cast<int>(mSlots.size()) - 1;
+      for(int index = 0; index < static_cast<int>(mEntries.size()); index++) {
+        int slot = static_cast<int>(mEntries[index].fingerprint.hash() & mask);
+        while(mSlots[slot] >= 0)
+          slot = (slot + 1) & mask;
+        mSlots[slot] = index;
+      }
+    }
+
+    std::vector<int> mSlots;
+    std::vector<Entry> mEntries;
+    std::vector<T*> mElements;
+    int mSize;
+  };
+
+} // namespace qr
+
+#endif // __QR_FINGERPRINT_H__
@@ -52,7 +52,7 @@ namespace qr {
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
 
   private:
-    Vector2d mOrigin, mDirection;
+    Vector mOrigin, mDirection;
   };
 
   typedef GLine<Vector2d> Line2d;
@@ -26,17 +26,6 @@ namespace qr {
 // -------------------------------------------------------------------------- //
 // Intersection details
 // -------------------------------------------------------------------------- //
-    template<class VectorA0, class VectorB0, class VectorA1, class VectorB1>
-    inline bool intersect(const VectorA0& a0, const VectorB0& b0, const VectorA1& a1, const VectorB1& b1, Vector2d* t) {
-      assert(a0.size() == b0.size() && a1.size() == b1.size() && a0.size() == a1.size());
-
-      Matrix<double, VectorA0::RowsAtCompileTime, 2> m(a0.size(), 2);
-      m.col(0) = b0;
-      m.col(1) = -b1;
-
-      return m.lu().solve(a1 - a0, t);
-    }
-
     template<class Matrix>
     inline bool linearlyDependent(const Matrix& m, double prec) {
       if(m.rows() < m.cols())
@@ -46,17 +35,72 @@ namespace qr {
       return std::abs(lu.matrixLU()(m.cols() - 1, m.cols() - 1)) < prec;
     }
 
+    /**
+     * Dimension-specific geometry kernels. 
+     * 
+     * Generic version goes through LU decomposition, 2d version is 
+     * specialized below with closed-form solutions. */
+    template<int dimension>
+    struct Kernels {
+      template<class VectorA0, class VectorB0, class VectorA1, class VectorB1>
+      static bool intersect(const VectorA0& a0, const VectorB0& b0, const VectorA1& a1, const VectorB1& b1, Vector2d* t) {
+        Matrix<double, VectorA0::RowsAtCompileTime, 2> m(a0.size(), 2);
+        m.col(0) = b0;
+        m.col(1) = -b1;
+
+        return m.lu().solve(a1 - a0, t);
+      }
+
+      template<class Vector0, class Vector1>
+      static bool linearlyDependent(const Vector0& v0, const Vector1& v1, double prec) {
+        if(v0.size() < 2)
+          return true;
+
+        Matrix<double, Vector0::RowsAtCompileTime, 2> m(v0.size(), 2);
+        m.col(0) = v0;
+        m.col(1) = v1;
+        return linearlyDependent(m, prec);
+      }
+    };
+
+    template<>
+    struct Kernels<2> {
+      /* Cramer's rule for [b0, -b1] * t = a1 - a0. */
+      template<class VectorA0, class VectorB0, class VectorA1, class VectorB1>
+      static bool intersect(const VectorA0& a0, const VectorB0& b0, const VectorA1& a1, const VectorB1& b1, Vector2d* t) {
+        double rx = a1[0] - a0[0], ry = a1[1] - a0[1];
+        double det = b1[0] * b0[1] - b0[0] * b1[1];
+        if(det == 0.0)
+          return false;
+
+        (*t)[0] = (b1[0] * ry - rx * b1[1]) / det;
+        (*t)[1] = (b0[0] * ry - rx * b0[1]) / det;
+        return true;
+      }
+
+      /* Full-pivoting LU of a 2x2 matrix leaves det / pivot in its last 
+       * diagonal element, pivot being the entry with the largest magnitude. */
+      template<class Vector0, class Vector1>
+      static bool linearlyDependent(const Vector0& v0, const Vector1& v1, double prec) {
+        double pivot = std::max(std::max(std::abs(v0[0]), std::abs(v0[1])), std::max(std::abs(v1[0]), std::abs(v1[1])));
+        if(pivot == 0.0)
+          return true;
+        return std::abs(v0[0] * v1[1] - v0[1] * v1[0]) / pivot < prec;
+      }
+    };
+
+    template<class VectorA0, class VectorB0, class VectorA1, class VectorB1>
+    inline bool intersect(const VectorA0& a0, const VectorB0& b0, const VectorA1& a1, const VectorB1& b1, Vector2d* t) {
+      assert(a0.size() == b0.size() && a1.size() == b1.size() && a0.size() == a1.size());
+
+      return Kernels<VectorA0::RowsAtCompileTime>::intersect(a0, b0, a1, b1, t);
+    }
+
     template<class Vector0, class Vector1>
     inline bool linearlyDependent(const Vector0& v0, const Vector1& v1, double prec) {
       assert(v0.size() == v1.size());
 
-      if(v0.size() < 2)
-        return true;
-
-      Matrix<double, Vector0::RowsAtCompileTime, 2> m(v0.size(), 2);
-      m.col(0) = v0;
-      m.col(1) = v1;
-      return linearlyDependent(m, prec);
+      return Kernels<Vector0::RowsAtCompileTime>::linearlyDependent(v0, v1, prec);
     }
 
     inline Vector1d vector1d(double point) {
@@ -71,36 +115,36 @@ namespace qr {
       return Rect1d(vector1d(point0), vector1d(point1 - point0));
     }
 
-    template<class VectorOrigin, class VectorDirection>
-    inline void clip(Rect1d& segment, const VectorOrigin& origin, const VectorDirection& direction, int axis, const Rect1d& axisSegment, double prec) {
-      assert(origin.size() == direction.size());
-
-      double originValue = origin[axis];
-      double directionValue = direction[axis];
-
-      if(std::abs(directionValue) < prec) {
-        if(!axisSegment.contains(vector1d(originValue), prec))
-          segment = Rect1d::emptyRect();
-        return;
-      }
-
-      double min = (axisSegment.min(0) - originValue) / directionValue;
-      double max = (axisSegment.max(0) - originValue) / directionValue;
-      if(min > max)
-        std::swap(min, max);
-
-      segment.intersect(rect1d(min, max));
+    /**
+     * Clips parameter range [tMin, tMax] of line origin + t * direction with 
+     * a single slab min <= x <= max.
+     *
+     * @returns                        False if the range became empty. */
+    inline bool clip(double& tMin, double& tMax, double origin, double direction, double min, double max, double prec) {
+      if(std::abs(direction) < prec)
+        return min - prec <= origin && origin - prec <= max;
+
+      double t0 = (min - origin) / direction;
+      double t1 = (max - origin) / direction;
+      tMin = std::max(tMin, std::min(t0, t1));
+      tMax = std::min(tMax, std::max(t0, t1));
+      return tMin - prec <= tMax;
     }
 
+    /* Slab test, one slab per axis. */
     template<class Vector, class VectorOrigin, class VectorDirection>
     inline bool intersects(const GRect<Vector>& rect, const VectorOrigin& origin, const VectorDirection& direction, Rect1d& intersection, double prec) {
       assert(origin.size() == direction.size() && rect.min().size() == origin.size());
 
+      double tMin = intersection.min(0), tMax = intersection.max(0);
       for(int i = 0; i < origin.size(); i++) {
-        clip(intersection, origin, direction, i, rect1d(rect.min(i), rect.max(i)), prec);
-        if(intersection.isEmpty(prec))
+        if(!clip(tMin, tMax, origin[i], direction[i], rect.min(i), rect.max(i), prec)) {
+          intersection = Rect1d::emptyRect();
           return false;
+        }
       }
+      intersection.setMin(0, tMin);
+      intersection.setMax(0, tMax);
       return true;
     }
 
@@ -119,7 +163,7 @@ namespace qr {
 
   template<class Vector>
   inline bool GLine<Vector>::isParallel(const GSegment<Vector>& segment, double prec) const {
-    return isParallel(segment.asLine());
+    return isParallel(segment.asLine(), prec);
   }
 
   template<class Vector>
@@ -220,6 +264,47 @@ namespace qr {
     return contains(segment.end(0), prec) && contains(segment.end(1), prec);
   }
 
+  /**
+   * Tests one segment against many rectangles.
+   *
+   * Per-axis data of the segment is computed once, so that the inner loop 
+   * consists of independent multiplications and min / max operations only.
+   *
+   * @param segment                    Segment to test.
+   * @param rects                      Rectangles to test against.
+   * @param count                      Number of rectangles.
+   * @param[out] results               Array of count values, i-th one is set to whether the segment intersects i-th rectangle. */
+  template<class Vector>
+  inline void intersects(const GSegment<Vector>& segment, const GRect<Vector>* rects, int count, bool* results, double prec) {
+    const int dimension = Vector::RowsAtCompileTime;
+    Vector direction = segment.end(1) - segment.end(0);
+
+    double inverse[dimension];
+    bool parallel[dimension];
+    for(int k = 0; k < dimension; k++) {
+      parallel[k] = std::abs(direction[k]) < prec;
+      inverse[k] = parallel[k] ? 0.0 : 1.0 / direction[k];
+    }
+
+    for(int i = 0; i < count; i++) {
+      const GRect<Vector>& rect = rects[i];
+      double tMin = 0.0, tMax = 1.0;
+      bool inside = true;
+      for(int k = 0; k < dimension; k++) {
+        double origin = segment.end(0)[k];
+        if(parallel[k]) {
+          inside = inside && rect.min(k) - prec <= origin && origin - prec <= rect.max(k);
+        } else {
+          double t0 = (rect.min(k) - origin) * inverse[k];
+          double t1 = (rect.max(k) - origin) * inverse[k];
+          tMin = std::max(tMin, std::min(t0, t1));
+          tMax = std::min(tMax, std::max(t0, t1));
+        }
+      }
+      results[i] = inside && tMin - prec <= tMax;
+    }
+  }
+
 
 // -------------------------------------------------------------------------- //
 // Operations on vectors
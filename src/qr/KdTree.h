@@ -0,0 +1,122 @@
+#ifndef __QR_KD_TREE_H__
+#define __QR_KD_TREE_H__
+
+#include "config.h"
+#include <cassert>
+#include <vector>
+#include <limits>
+#include <algorithm> /* for std::nth_element() */
+#include "Algebra.h"
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// KdTree
+// -------------------------------------------------------------------------- //
+  /**
+   * KdTree is a static 2d-tree for nearest point queries.
+   *
+   * Points are added first, then the tree is built once and queried. When
+   * several points are equally close to the query point, the one that was
+   * added first wins, which matches a linear scan with a strict "<" test. */
+  template<class T>
+  class KdTree {
+  public:
+    KdTree(): mIsBuilt(true) {}
+
+    void add(const Vector2d& point, const T& value) {
+      Node node;
+      node.pos[0] = point.x();
+      node.pos[1] = point.y();
+      node.value = value;
+      node.index = static_cast<int>(mNodes.size());
+      mNodes.push_back(node);
+      mIsBuilt = false;
+    }
+
+    void build() {
+      build(0, static_cast<int>(mNodes.size()), 0);
+      mIsBuilt = true;
+    }
+
+    bool isEmpty() const {
+      return mNodes.empty();
+    }
+
+    int size() const {
+      return static_cast<int>(mNodes.size());
+    }
+
+    /** @returns                       Value of the point closest to the given one. */
+    const T& nearest(const Vector2d& point) const {
+      assert(mIsBuilt && !isEmpty());
+
+      double pos[2] = {point.x(), point.y()};
+      int best = -1;
+      double bestSquaredNorm = std::numeric_limits<double>::max();
+      nearest(0, static_cast<int>(mNodes.size()), 0, pos, &best, &bestSquaredNorm);
+      return mNodes[best].value;
+    }
+
+  private:
+    struct Node {
+      double pos[2];
+      T value;
+      int index;
+    };
+
+    class AxisLess {
+    public:
+      AxisLess(int axis): mAxis(axis) {}
+
+      bool operator() (const Node& a, const Node& b) const {
+        return a.pos[mAxis] < b.pos[mAxis];
+      }
+
+    private:
+      int mAxis;
+    };
+
+    void build(int lo, int hi, int depth) {
+      if(hi - lo <= 1)
+        return;
+
+      int mid = (lo + hi) / 2;
+      std::nth_element(mNodes.begin() + lo, mNodes.begin() + mid, mNodes.begin() + hi, AxisLess(depth % 2));
+      build(lo, mid, depth + 1);
+      build(mid + 1, hi, depth + 1);
+    }
+
+    void nearest(int lo, int hi, int depth, const double* pos, int* best, double* bestSquaredNorm) const {
+      if(lo >= hi)
+        return;
+
+      int mid = (lo + hi) / 2;
+      const Node& node = mNodes[mid];
+
+      double dx = pos[0] - node.pos[0];
+      double dy = pos[1] - node.pos[1];
+      double squaredNorm = dx * dx + dy * dy;
+      if(squaredNorm < *bestSquaredNorm || (squaredNorm == *bestSquaredNorm && node.index < mNodes[*best].index)) {
+        *bestSquaredNorm = squaredNorm;
+        *best = mid;
+      }
+
+      double delta = pos[depth % 2] - node.pos[depth % 2];
+      if(delta < 0) {
+        nearest(lo, mid, depth + 1, pos, best, bestSquaredNorm);
+        if(delta * delta <= *bestSquaredNorm)
+          nearest(mid + 1, hi, depth + 1, pos, best, bestSquaredNorm);
+      } else {
+        nearest(mid + 1, hi, depth + 1, pos, best, bestSquaredNorm);
+        if(delta * delta <= *bestSquaredNorm)
+          nearest(lo, mid, depth + 1, pos, best, bestSquaredNorm);
+      }
+    }
+
+    std::vector<Node> mNodes;
+    bool mIsBuilt;
+  };
+
+} // namespace qr
+
+#endif // __QR_KD_TREE_H__
@@ -11,8 +11,11 @@
 #include "Primitive.h"
 #include "Edge.h"
 #include "Vertex.h"
+#include "Predicates.h"
 
 namespace qr {
+  class LoopSpan;
+
 // -------------------------------------------------------------------------- //
 // LoopVertex
 // -------------------------------------------------------------------------- //
@@ -62,6 +65,8 @@ namespace qr {
       mIsSolid(false),
       mIsDisjoint(false), 
       mIsHatched(false), 
+      mIsFrozen(false),
+      mSpan(NULL),
       mIsVerticesValid(false),
       mIsVertexSetValid(false),
       mIsBoundingRectValid(false), 
@@ -69,6 +74,7 @@ namespace qr {
     {}
 
     void addEdge(Edge* edge) {
+      assert(!mIsFrozen);
       assert(!mEdges.contains(edge));
       assert(mEdges.isEmpty() || mEdges.back()->isExtension(edge, 1.0e-6)); /* TODO: EPS */
 
@@ -88,6 +94,8 @@ namespace qr {
     }
 
     void reverse() {
+      assert(!mIsFrozen);
+
       std::reverse(mEdges.begin(), mEdges.end());
       mIsVertexSetValid = false;
       mIsVerticesValid = false;
@@ -102,7 +110,7 @@ namespace qr {
           Edge* prevEdge = mEdges[i0];
           Edge* nextEdge = mEdges[(i0 + 1) % mEdges.size()];
           Vertex* vertex = prevEdge->commonVertex(nextEdge);
-          LoopVertex::Type type = isCollinear(prevEdge->tangent(vertex), nextEdge->tangent(vertex), 1.0e-4) ? LoopVertex::TANGENT : LoopVertex::NORMAL; /* TODO: EPS */
+          LoopVertex::Type type = isParallel(prevEdge->tangent(vertex), nextEdge->tangent(vertex), 1.0e-4) ? LoopVertex::TANGENT : LoopVertex::NORMAL; /* TODO: EPS */
           mVertices.push_back(LoopVertex(type, prevEdge, nextEdge, vertex)); 
         }
         mIsVerticesValid = true;
@@ -183,12 +191,54 @@ namespace qr {
       return mBoundingRect3d;
     }
 
+    bool isFrozen() const {
+      return mIsFrozen;
+    }
+
+    /**
+     * Freezes this loop. 
+     * 
+     * Vertices, vertex set and bounding rects are computed once and are never
+     * rebuilt afterwards, so this must be called only after 3d positions of 
+     * loop vertices are known. Edges of a frozen loop cannot be changed. */
+    void freeze() {
+      assert(mEdges.size() > 1);
+
+      mIsVerticesValid = false;
+      mIsVertexSetValid = false;
+      mIsBoundingRectValid = false;
+      mIsBoundingRect3dValid = false;
+      vertices();
+      vertexSet();
+      boundingRect();
+      boundingRect3d();
+      mIsFrozen = true;
+    }
+
+    /** @returns                       Span of this loop in the loop table of its view. */
+    const LoopSpan& span() const {
+      assert(mSpan != NULL);
+
+      return *mSpan;
+    }
+
   private:
+    friend class LoopTable;
+
+    void setSpan(const LoopSpan* span) {
+      assert(mIsFrozen);
+
+      mSpan = span;
+    }
+
+
     bool mIsSolid;
     bool mIsFundamental;
     bool mIsDisjoint;
     bool mIsHatched;
+    bool mIsFrozen;
     QList<Edge*> mEdges;
+    const LoopSpan* mSpan;
 
     mutable bool mIsVerticesValid;
     mutable QList<LoopVertex> mVertices;
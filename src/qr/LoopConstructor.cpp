@@ -1,89 +1,199 @@
 #include "LoopConstructor.h"
 #include <limits>
-#include <algorithm> /* for std::swap() */
-#include <set>
+#include <vector>
+#include <algorithm> /* for std::sort() */
+#include <Eigen/StdVector>
 #include <QSet>
+#include <QHash>
+#include <QVector>
+#include "Fingerprint.h"
+#include "Predicates.h"
+#include "Parallel.h"
 
 namespace qr {
   namespace {
-    Loop* traceLoop(Edge* startEdge, Vertex* startVertex, double* sumAngle, double prec) {
-      Vertex* endVertex = startEdge->otherVertex(startVertex);
+    bool isLoopEdge(Edge* edge) {
+      return edge->role() == Edge::PHANTOM || edge->role() == Edge::NORMAL;
+    }
 
-      Loop* loop = new Loop();
-      loop->addEdge(startEdge);
+    /**
+     * Doubly-connected edge list over the loop-forming edges of a view.
+     *
+     * Half-edge 2 * i runs from vertex(0) to vertex(1) of the i-th edge, 
+     * half-edge 2 * i + 1 runs back. The half-edge that follows an incoming one
+     * is the first outgoing half-edge clockwise from its twin, so walking along
+     * next() traces faces in the same way the old edge-by-edge tracing did: 
+     * bounded faces counterclockwise, outer boundaries clockwise (type-2). */
+    class HalfEdgeGraph {
+    public:
+      HalfEdgeGraph(View* view) {
+        foreach(Edge* edge, view->edges()) {
+          if(!isLoopEdge(edge))
+            continue;
 
-      Edge* edge = startEdge;
-      Vertex* vertex = startVertex;
-      *sumAngle = 0.0;
+          mEdgeIndices[edge] = mEdges.size();
+          mEdges.push_back(edge);
+        }
 
-      while(true) {
-        /*std::vector<Edge*> edges;
-        std::copy(loop->edges().begin(), loop->edges().end(), std::back_inserter(edges));
+        int halfEdgeCount = mEdges.size() * 2;
 
-        if((vertex->pos2d() - Vector2d(0.0, 66.0)).isZero(0.001)) {
-          int x  =1;
-        }*/
+        /* Bucket outgoing half-edges by their origin vertices. */
+        QHash<Vertex*, int> vertexIndices;
+        foreach(Vertex* vertex, view->vertices()) {
+          int vertexIndex = vertexIndices.size();
+          vertexIndices[vertex] = vertexIndex;
+        }
 
-        Edge* nextEdge = NULL;
-        double minAngle = std::numeric_limits<double>::max();
-        foreach(Edge* otherEdge, edge->extensions(vertex->pos2d(), prec)) {
-          if(otherEdge->role() != Edge::PHANTOM && otherEdge->role() != Edge::NORMAL)
+        QVector<int> origins(halfEdgeCount);
+        QVector<int> offsets(vertexIndices.size() + 1, 0);
+        mDirections.resize(halfEdgeCount);
+        mPseudoAngles.resize(halfEdgeCount);
+        for(int h = 0; h < halfEdgeCount; h++) {
+          mDirections[h] = target(h)->pos2d() - origin(h)->pos2d();
+          mPseudoAngles[h] = pseudoAngle(mDirections[h]);
+          origins[h] = vertexIndices[origin(h)];
+          offsets[origins[h] + 1]++;
+        }
+        for(int v = 0; v < vertexIndices.size(); v++)
+          offsets[v + 1] += offsets[v];
+
+        QVector<int> outgoing(halfEdgeCount);
+        QVector<int> fill = offsets;
+        for(int h = 0; h < halfEdgeCount; h++)
+          outgoing[fill[origins[h]]++] = h;
+
+        /* Sort them counterclockwise once per vertex and link the half-edges. */
+        mNext.resize(halfEdgeCount);
+        for(int v = 0; v < vertexIndices.size(); v++) {
+          int lo = offsets[v], hi = offsets[v + 1];
+          std::sort(outgoing.begin() + lo, outgoing.begin() + hi, AngleLess(this));
+
+          for(int k = lo; k < hi; k++)
+            mNext[twin(outgoing[k])] = outgoing[k == lo ? hi - 1 : k - 1];
+        }
+
+        /* Enumerate all faces in one pass. */
+        mFaces.fill(-1, halfEdgeCount);
+        QVector<int> edgeFaces(mEdges.size(), -1);
+        for(int h = 0; h < halfEdgeCount; h++) {
+          if(mFaces[h] != -1)
             continue;
 
-          Vector2d edgeDir = (edge->otherEnd(vertex->pos2d(), prec) - vertex->pos2d()).normalized();
-          Vector2d otherEdgeDir = (otherEdge->otherEnd(vertex->pos2d(), prec) - vertex->pos2d()).normalized();
+          Face face;
+          face.isClosed = true;
+          int faceIndex = mFaceList.size();
+          int size = 0, upperCount = 0, wrapCount = 0;
+          int g = h;
+          do {
+            mFaces[g] = faceIndex;
 
-          Vector3d cross = Vector3d(otherEdgeDir.x(), otherEdgeDir.y(), 0.0).cross(Vector3d(edgeDir.x(), edgeDir.y(), 0.0));
+            /* Faces that pass an edge in both directions do not bound anything. */
+            if(edgeFaces[g / 2] == faceIndex)
+              face.isClosed = false;
+            edgeFaces[g / 2] = faceIndex;
 
-          double angle = acos(std::max(-1.0, std::min(1.0, edgeDir.dot(otherEdgeDir))));
-          if(cross.z() < 0)
-            angle = -angle + 2 * M_PI;
+            if(directionHalf(mDirections[g]) == 0)
+              upperCount++;
+            if(isDirectionLess(twin(g), mNext[g]))
+              wrapCount++;
+            size++;
+            g = mNext[g];
+          } while(g != h);
 
-          if(angle < minAngle) {
-            minAngle = angle;
-            nextEdge = otherEdge;
-          }
+          /* Sum of clockwise turn angles, each being the angle of the twin minus 
+           * the angle of the next half-edge taken in [0, 2 * pi), is (n - 2) * pi 
+           * for counterclockwise faces and (n + 2) * pi for clockwise ones. 
+           * Angles of consecutive half-edges cancel out in this sum, leaving 
+           * +pi for each half-edge in the upper half-plane, -pi for each one in
+           * the lower half-plane and 2 * pi for each turn that wraps around. */
+          face.isType2 = 2 * upperCount - size + 2 * wrapCount > size;
+          mFaceList.push_back(face);
         }
-          
-        *sumAngle += minAngle;
-        if(nextEdge == NULL)
-          break;
-        
-        loop->addEdge(nextEdge);
-        edge = nextEdge;
-        vertex = nextEdge->otherVertex(vertex);
+      }
 
-        if(vertex == endVertex)
-          break;
+      const QList<Edge*>& edges() const {
+        return mEdges;
+      }
+
+      /** @returns                     Half-edge of the given edge that starts at its vertex(endIndex). */
+      int halfEdge(Edge* edge, int endIndex) const {
+        assert(mEdgeIndices.contains(edge));
+
+        return 2 * mEdgeIndices[edge] + endIndex;
       }
 
-      if(vertex == endVertex) {
+      int twin(int halfEdge) const {
+        return halfEdge ^ 1;
+      }
+
+      Vertex* origin(int halfEdge) const {
+        return mEdges[halfEdge / 2]->vertex(halfEdge % 2);
+      }
+
+      Vertex* target(int halfEdge) const {
+        return mEdges[halfEdge / 2]->vertex(1 - halfEdge % 2);
+      }
+
+      bool isClosed(int halfEdge) const {
+        return mFaceList[mFaces[halfEdge]].isClosed;
+      }
+
+      bool isType2(int halfEdge) const {
+        return mFaceList[mFaces[halfEdge]].isType2;
+      }
+
+      /** @returns                     Newly created loop for the face of the given half-edge, starting with its edge. */
+      Loop* loop(int halfEdge) const {
+        assert(isClosed(halfEdge));
+
+        Loop* loop = new Loop();
         bool isSolid = true;
-        foreach(Edge* edge, loop->edges())
+        int h = halfEdge;
+        do {
+          Edge* edge = mEdges[h / 2];
           if(edge->role() == Edge::PHANTOM)
             isSolid = false;
+          loop->addEdge(edge);
+          h = mNext[h];
+        } while(h != halfEdge);
         loop->setSolid(isSolid);
-
-        /*QColor color = QColor(rand() * 255 / RAND_MAX, rand() * 255 / RAND_MAX, rand() * 255 / RAND_MAX);
-        foreach(Edge* edge, loop->edges())
-          edge->setPen(QPen(color));*/
-
         return loop;
-      } else {
-        delete loop;
-        return NULL;
       }
-    }
 
-    bool isType2(Loop* loop, double sumAngle, double prec) {
-      return sumAngle > (loop->edges().size() - 2) * M_PI + prec;
-    }
+    private:
+      struct Face {
+        bool isClosed;
+        bool isType2;
+      };
 
-    std::set<Edge*> edgeSet(Loop* loop) {
-      std::set<Edge*> result;
-      result.insert(loop->edges().begin(), loop->edges().end());
-      return result;
-    }
+      class AngleLess {
+      public:
+        AngleLess(const HalfEdgeGraph* graph): mGraph(graph) {}
+
+        bool operator() (int a, int b) const {
+          if(mGraph->isDirectionLess(a, b))
+            return true;
+          if(mGraph->isDirectionLess(b, a))
+            return false;
+          return a < b;
+        }
+
+      private:
+        const HalfEdgeGraph* mGraph;
+      };
+
+      bool isDirectionLess(int a, int b) const {
+        return qr::isDirectionLess(mDirections[a], mPseudoAngles[a], mDirections[b], mPseudoAngles[b]);
+      }
+
+      QList<Edge*> mEdges;
+      QHash<Edge*, int> mEdgeIndices;
+      std::vector<Vector2d, Eigen::aligned_allocator<Vector2d> > mDirections;
+      QVector<double> mPseudoAngles;
+      QVector<int> mNext;
+      QVector<int> mFaces;
+      QList<Face> mFaceList;
+    };
 
   } // namespace
 
@@ -91,25 +201,33 @@ namespace qr {
 // LoopConstructor
 // -------------------------------------------------------------------------- //
   void LoopConstructor::operator() () {
-    foreach(View* view, mViews) {
-      QSet<Edge*> visitedEdges;
-
-      std::set<std::set<Edge*>> loopSet;
-
-      /* Create outer loop. */
-      Edge* outerEdge = NULL;
-      double minX = std::numeric_limits<double>::max();
-      foreach(Edge* edge, view->edges()) {
-        double x = edge->boundingRect().center().x();
-        if(x < minX) {
-          minX = x;
-          outerEdge = edge;
-        }
+    /* Views share no edges or vertices, so they can be processed concurrently. */
+    parallelForEach(mViews, this, &LoopConstructor::constructLoops);
+  }
+
+  void LoopConstructor::constructLoops(View* view) const {
+    HalfEdgeGraph graph(view);
+
+    FingerprintSet<Edge> loopSet;
+
+    /* Create outer loop. */
+    Edge* outerEdge = NULL;
+    double minX = std::numeric_limits<double>::max();
+    foreach(Edge* edge, graph.edges()) {
+      double x = edge->boundingRect().center().x();
+      if(x < minX) {
+        minX = x;
+        outerEdge = edge;
       }
-      double sumAngle = 0.0;
-      Loop* outerLoop = traceLoop(outerEdge, outerEdge->vertex(0), &sumAngle, mPrec);
-      if(!isType2(outerLoop, sumAngle, mPrec))
-        outerLoop = traceLoop(outerEdge, outerEdge->vertex(1), &sumAngle, mPrec);
+    }
+    int outerHalfEdge = graph.halfEdge(outerEdge, 1);
+    if(!graph.isType2(outerHalfEdge))
+      outerHalfEdge = graph.twin(outerHalfEdge);
+
+    /* A dangling edge on the contour makes the face pass it twice, such a
+     * view is left without an outer loop. */
+    if(graph.isClosed(outerHalfEdge)) {
+      Loop* outerLoop = graph.loop(outerHalfEdge);
       outerLoop->reverse(); /* Turn it into type-1. */
       outerLoop->setFundamental(false);
       outerLoop->setSolid(true);
@@ -117,89 +235,78 @@ namespace qr {
       outerLoop->setHatched(false);
       view->add(outerLoop);
       view->setOuterLoop(outerLoop);
-      loopSet.insert(edgeSet(outerLoop));
-
-      /* Create fundamental loops. */
-      while(true) {
-        Edge* startEdge = NULL;
-        foreach(Edge* otherEdge, view->edges()) {
-          if((otherEdge->role() == Edge::PHANTOM || otherEdge->role() == Edge::NORMAL) && !visitedEdges.contains(otherEdge)) {
-            startEdge = otherEdge;
-            break;
-          }
-        }
-        if(startEdge == NULL)
-          break;
-
-        visitedEdges.insert(startEdge);
+      loopSet.insert(outerLoop->edges().begin(), outerLoop->edges().end());
+    }
 
-        Vertex* startVertex = startEdge->vertex(1);
-        double sumAngle = 0.0;
+    /* Create fundamental loops. */
+    QSet<Edge*> visitedEdges;
+    foreach(Edge* startEdge, graph.edges()) {
+      if(visitedEdges.contains(startEdge))
+        continue;
 
-        Loop* loop = traceLoop(startEdge, startVertex, &sumAngle, mPrec);
-        if(loop == NULL)
-          continue;
-        if(isType2(loop, sumAngle, mPrec)) {
-          /* That's a type-2 loop, we don't need it yet. */
-          delete loop; 
-          loop = traceLoop(startEdge, startEdge->otherVertex(startVertex), &sumAngle, mPrec);
-          if(loop == NULL)
-            continue;
-        }
+      visitedEdges.insert(startEdge);
 
-        /* Check duplicates. */
-        std::set<Edge*> loopEdges = edgeSet(loop);
-        if(loopSet.find(loopEdges) != loopSet.end()) {
-          delete loop;
+      int halfEdge = graph.halfEdge(startEdge, 0);
+      if(!graph.isClosed(halfEdge))
+        continue;
+      if(graph.isType2(halfEdge)) {
+        /* That's a type-2 loop, we don't need it yet. */
+        halfEdge = graph.twin(halfEdge);
+        if(!graph.isClosed(halfEdge))
           continue;
-        }
-        loopSet.insert(loopEdges);
+      }
+      Loop* loop = graph.loop(halfEdge);
 
-        loop->setFundamental(true);
-        view->add(loop);
-        foreach(Edge* edge, loop->edges())
-          visitedEdges.insert(edge);
+      /* Check duplicates. */
+      if(!loopSet.insert(loop->edges().begin(), loop->edges().end())) {
+        delete loop;
+        continue;
       }
 
-      /* Register loops in edges. */
-      foreach(Loop* loop, view->loops())
-        foreach(Edge* edge, loop->edges())
-          edge->addLoop(loop);
-
-      /* Find disjoint loops. */
-      foreach(Loop* loop, view->loops()) {
-        bool isDisjoint = true;
-        foreach(Edge* edge, loop->edges()) {
-          if(edge->loops().size() > 1) {
-            isDisjoint = false;
-          }
+      loop->setFundamental(true);
+      view->add(loop);
+      foreach(Edge* edge, loop->edges())
+        visitedEdges.insert(edge);
+    }
+
+    /* Register loops in edges. */
+    foreach(Loop* loop, view->loops())
+      foreach(Edge* edge, loop->edges())
+        edge->addLoop(loop);
+
+    /* Find disjoint loops. */
+    foreach(Loop* loop, view->loops()) {
+      bool isDisjoint = true;
+      foreach(Edge* edge, loop->edges()) {
+        if(edge->loops().size() > 1) {
+          isDisjoint = false;
         }
-        loop->setDisjoint(isDisjoint);
       }
-      /* TODO: mark solid loops connected by dotted edges only as disjoint */
+      loop->setDisjoint(isDisjoint);
+    }
+    /* TODO: mark solid loops connected by dotted edges only as disjoint */
 
-      /* Mark hatched loops. */
-      foreach(Loop* loop, view->loops()) {
-        if(loop->view()->type() != View::SECTIONAL)
-          continue;
+    /* Mark hatched loops. */
+    foreach(Loop* loop, view->loops()) {
+      if(loop->view()->type() != View::SECTIONAL)
+        continue;
 
-        bool isHatched = true;
-        Hatch* hatch = NULL;
-        foreach(Edge* edge, loop->edges()) {
-          if(edge->hatch() != NULL) {
-            if(hatch == NULL) {
-              hatch = edge->hatch();
-            } else if(hatch != edge->hatch()) {
-              isHatched = false;
-              break;
-            }
-          } else {
+      bool isHatched = true;
+      Hatch* hatch = NULL;
+      foreach(Edge* edge, loop->edges()) {
+        if(edge->hatch() != NULL) {
+          if(hatch == NULL) {
+            hatch = edge->hatch();
+          } else if(hatch != edge->hatch()) {
             isHatched = false;
             break;
           }
+        } else {
+          isHatched = false;
+          break;
         }
-        loop->setHatched(isHatched);
       }
+      loop->setHatched(isHatched);
     }
   }
 
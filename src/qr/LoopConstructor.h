@@ -11,13 +11,14 @@ namespace qr {
 // -------------------------------------------------------------------------- //
   class LoopConstructor {
   public:
-    LoopConstructor(QList<View*> views, double prec): mViews(views), mPrec(prec) {}
+    LoopConstructor(QList<View*> views): mViews(views) {}
 
     void operator() ();
 
   private:
+    void constructLoops(View* view) const;
+
     QList<View*> mViews;
-    double mPrec;
   };
 
 } // namespace qr
@@ -1,9 +1,11 @@
 #include "LoopExtruder.h"
-#include <algorithm> /* for std::swap() */
+#include <algorithm> /* for std::swap(), std::min(), std::max() */
 #include <carve/input.hpp>
 #include "ViewBox.h"
+#include "Tessellation.h"
 #include "Utility.h"
 #include "Debug.h"
+#include "CarveLock.h"
 
 namespace qr {
 // -------------------------------------------------------------------------- //
@@ -16,14 +18,25 @@ namespace qr {
     double lo = mLoop->view()->viewBox()->boundingRect().min(idx);
     double hi = mLoop->view()->viewBox()->boundingRect().max(idx);
 
-    if(std::abs(mLoop->edge(0)->vertex(0)->pos3d()[idx] - lo) < 1.0e-5) /* TODO: EPS */
-      std::swap(lo, hi);
+    bool swap = std::abs(mLoop->edge(0)->vertex(0)->pos3d()[idx] - lo) < 1.0e-5; /* TODO: EPS */
 
     double correction = mLoop->view()->viewBox()->boundingRect().size(idx);
-    lo += (lo > hi ? 1.0 : -1.0) * correction;
-    hi += (hi > lo ? 1.0 : -1.0) * correction;
+
+    /* Limit extrusion to the given depth range, the margin then only has to cover the tolerance. */
+    if((mDepthMin > lo || mDepthMax < hi) && std::max(lo, mDepthMin) <= std::min(hi, mDepthMax)) {
+      lo = std::max(lo, mDepthMin);
+      hi = std::min(hi, mDepthMax);
+      correction = 0.1 * (hi - lo) + 1.0e-3; /* TODO: EPS */
+    }
+
+    lo -= correction;
+    hi += correction;
+    if(swap)
+      std::swap(lo, hi);
 
     /* Add vertices. */
+    Tessellation tessellation = Tessellation::forPart(mLoop->view()->viewBox()->boundingRect());
+    Tessellation::PointVector points;
     foreach(const LoopVertex& loopVertex, mLoop->vertices()) {
       if(loopVertex.prevEdge()->type() == Edge::LINE && loopVertex.nextEdge()->type() == Edge::LINE && loopVertex.type() == LoopVertex::TANGENT)
         continue;
@@ -40,12 +53,15 @@ namespace qr {
       } else if(edge->type() == Edge::ARC) {
         bool forward = edge->vertex(0) == loopVertex.vertex();
 
-        int start = forward ? 0 : 10;
+        points.clear();
+        tessellation.arcPoints(edge->asArc(), points);
+        int segmentCount = static_cast<int>(points.size()) - 1;
+
+        int start = forward ? 0 : segmentCount;
         int delta = forward ? 1 : -1;
 
-        const Edge::ArcData& arc = edge->asArc();
-        for(int i = 0; i < 10; i++) {
-          Vector2d v2 = arc.point((start + i * delta) / 10.0);
+        for(int i = 0; i < segmentCount; i++) {
+          const Vector2d& v2 = points[start + i * delta];
           Vector3d v = mLoop->view()->transform() * Vector3d(v2.x(), v2.y(), 0.0);
 
           v[idx] = lo;
@@ -74,6 +90,7 @@ namespace qr {
       base[i] = i * 2 + 1;
     data.addFace(base.begin(), base.end());
 
+    CarveLock locker;
     carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
     result->canonicalize();
     //debugShowPoly(result);
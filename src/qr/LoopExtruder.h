@@ -2,8 +2,16 @@
 #define __QR_LOOP_EXTRUDER_H__
 
 #include "config.h"
+#include <limits>
+#include <cstring> /* for std::memcpy() */
+#include <boost/noncopyable.hpp>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <carve/poly.hpp>
 #include "Loop.h"
+#include "CsgCuller.h"
+#include "CarveLock.h"
 
 namespace qr {
 // -------------------------------------------------------------------------- //
@@ -11,11 +19,114 @@ namespace qr {
 // -------------------------------------------------------------------------- //
   class LoopExtruder {
   public:
-    LoopExtruder(Loop* loop): mLoop(loop) {}
+    /** Constructor for extrusion through the whole view box. */
+    LoopExtruder(Loop* loop): mLoop(loop), mDepthMin(-std::numeric_limits<double>::max()), mDepthMax(std::numeric_limits<double>::max()) {}
+
+    /**
+     * Constructor for extrusion limited to the given range along the
+     * extrusion axis, e.g. to the known depth of the loop formation. The
+     * range is widened by a small margin. */
+    LoopExtruder(Loop* loop, double depthMin, double depthMax): mLoop(loop), mDepthMin(depthMin), mDepthMax(depthMax) {}
 
     carve::poly::Polyhedron* operator() ();
   private:
     Loop* mLoop;
+    double mDepthMin, mDepthMax;
+  };
+
+
+// -------------------------------------------------------------------------- //
+// LoopExtrusionCache
+// -------------------------------------------------------------------------- //
+  /**
+   * Cache of loop prisms, keyed by the loop and the depth range.
+   *
+   * Each loop is extruded only once for each depth range, and every request
+   * gets its own copy of the prism that can be handed over to a CSG node. */
+  class LoopExtrusionCache: private boost::noncopyable {
+  public:
+    ~LoopExtrusionCache() {
+      qDeleteAll(mPolys);
+    }
+
+    /** @returns                       New copy of the loop extruded over the given depth range, owned by the caller. */
+    carve::poly::Polyhedron* extrude(Loop* loop, double depthMin, double depthMax) {
+      carve::poly::Polyhedron* poly = prism(Key(loop, depthMin, depthMax));
+
+      CarveLock locker;
+      return new carve::poly::Polyhedron(*poly);
+    }
+
+    /** @returns                       Bounding box of the loop extruded over the given depth range. */
+    Rect3d boundingRect(Loop* loop, double depthMin, double depthMax) {
+      Key key(loop, depthMin, depthMax);
+      prism(key);
+
+      QMutexLocker locker(&mMutex);
+      return mRects.value(key);
+    }
+
+    /** @returns                       True if the loop extruded over the given depth range is exactly its bounding box. */
+    bool isBox(Loop* loop, double depthMin, double depthMax) {
+      Key key(loop, depthMin, depthMax);
+      prism(key);
+
+      QMutexLocker locker(&mMutex);
+      return mBoxes.value(key);
+    }
+
+  private:
+    struct Key {
+      Key(Loop* loop, double depthMin, double depthMax): loop(loop), depthMin(depthMin), depthMax(depthMax) {}
+
+      bool operator== (const Key& other) const {
+        return loop == other.loop && depthMin == other.depthMin && depthMax == other.depthMax;
+      }
+
+      friend uint qHash(const Key& key) {
+        return qHash(key.loop) ^ (qHash(bits(key.depthMin)) * 31) ^ (qHash(bits(key.depthMax)) * 961);
+      }
+
+      static quint64 bits(double value) {
+        quint64 result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+      }
+
+      Loop* loop;
+      double depthMin, depthMax;
+    };
+
+    carve::poly::Polyhedron* prism(const Key& key) {
+      {
+        QMutexLocker locker(&mMutex);
+        carve::poly::Polyhedron* poly = mPolys.value(key, NULL);
+        if(poly != NULL)
+          return poly;
+      }
+
+      /* Extrude without holding the lock, another thread may beat us to it. */
+      carve::poly::Polyhedron* newPoly = LoopExtruder(key.loop, key.depthMin, key.depthMax)();
+      Rect3d newRect = CsgCuller::boundingRect(newPoly);
+      bool newIsBox = CsgCuller::isBox(newPoly);
+
+      QMutexLocker locker(&mMutex);
+      carve::poly::Polyhedron* poly = mPolys.value(key, NULL);
+      if(poly != NULL) {
+        delete newPoly;
+        return poly;
+      }
+
+      mPolys.insert(key, newPoly);
+      mRects.insert(key, newRect);
+      mBoxes.insert(key, newIsBox);
+      return newPoly;
+    }
+
+    QMutex mMutex;
+    QHash<Key, carve::poly::Polyhedron*> mPolys;
+    QHash<Key, Rect3d> mRects;
+    QHash<Key, bool> mBoxes;
   };
 
 } // namespace qr
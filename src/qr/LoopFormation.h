@@ -20,6 +20,13 @@ namespace qr {
       Vector3d topX, topY;
     };
 
+    /** Right circular cylinder, a prism over a circle loop. */
+    struct Cylinder {
+      Loop* circle;
+      Vector3d base;   /**< Center of the base, in the plane of the circle's view. */
+      Vector3d height; /**< Along the perpendicular axis of the circle's view. */
+    };
+
     enum Type {
       PROTRUSION,
       DEPRESSION,
@@ -28,7 +35,8 @@ namespace qr {
 
     enum Class {
       NORMAL,
-      CONE
+      CONE,
+      CYLINDER
     };
 
     LoopFormation(): mType(UNKNOWN), mClass(NORMAL) {}
@@ -73,11 +81,22 @@ namespace qr {
       return mCone;
     }
 
+    const Cylinder& asCylinder() const {
+      assert(mClass == CYLINDER);
+      return mCylinder;
+    }
+
+    Cylinder& asCylinder() {
+      assert(mClass == CYLINDER);
+      return mCylinder;
+    }
+
   private:
     Type mType;
     Class mClass;
     QList<Loop*> mLoops;
     Cone mCone;
+    Cylinder mCylinder;
   };
 
 } // namespace qr
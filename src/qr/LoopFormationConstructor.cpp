@@ -1,211 +1,332 @@
 #include "LoopFormationConstructor.h"
-#include <set>
+#include <vector>
+#include <utility> /* for std::pair */
+#include <algorithm> /* for std::sort(), std::lower_bound(), std::min(), std::max() */
+#include <limits>
 #include <boost/foreach.hpp>
 #include "LoopMerger.h"
 #include "LoopUtils.h"
+#include "Fingerprint.h"
+#include "Parallel.h"
 
 namespace qr {
   namespace {
-    QList<double> loopPoints(Loop* loop, int idx, bool normalOnly) {
-      QList<double> result;
-      result.push_back(loop->boundingRect3d().min(idx));
-      result.push_back(loop->boundingRect3d().max(idx));
-      foreach(const LoopVertex& vertex, loop->vertices())
-        if(vertex.type() == LoopVertex::NORMAL || !normalOnly)
-          result.push_back(vertex.vertex()->pos3d(idx));
-      return result;
+    /**
+     * Both ranges must be sorted, so that a single linear merge is enough.
+     *
+     * @returns                        True if every point in [aBegin, aEnd) is closer than prec to some point in [bBegin, bEnd). */
+    bool covers(const double* aBegin, const double* aEnd, const double* bBegin, const double* bEnd, double prec) {
+      const double* b = bBegin;
+      for(const double* a = aBegin; a != aEnd; ++a) {
+        /* Points of b that are too far below a are too far below all the next points of a too. */
+        while(b != bEnd && *a - *b >= prec)
+          ++b;
+        if(b == bEnd || std::abs(*a - *b) >= prec)
+          return false;
+      }
+      return true;
+    }
+
+    /** 
+     * @returns                        True if bounds and NORMAL vertices of the source loop along the given axis
+     *                                 all lie close to vertices of the target loop. */
+    bool covers(const LoopSpan& src, const LoopSpan& target, int idx, double prec) {
+      /* Bounds of the target are attained at its vertices, so there is no need to test against them. */
+      const double* bBegin = target.coordinates(idx);
+      const double* bEnd = bBegin + target.coordinateCount(idx);
+
+      double bounds[2] = {src.boundingRect3d().min(idx), src.boundingRect3d().max(idx)};
+      if(!covers(bounds, bounds + 2, bBegin, bEnd, prec))
+        return false;
+
+      const double* aBegin = src.normalCoordinates(idx);
+      return covers(aBegin, aBegin + src.normalCoordinateCount(idx), bBegin, bEnd, prec);
     }
 
     bool matches(Loop* srcLoop, Loop* targetLoop, double prec) {
       assert(srcLoop->view()->perpendicularAxisIndex() != targetLoop->view()->perpendicularAxisIndex());
 
       int idx = 3 - srcLoop->view()->perpendicularAxisIndex() - targetLoop->view()->perpendicularAxisIndex();
+
+      const LoopSpan& src = srcLoop->span();
+      const LoopSpan& target = targetLoop->span();
   
-      if(std::abs(srcLoop->boundingRect3d().min(idx) - targetLoop->boundingRect3d().min(idx)) > prec)
+      if(std::abs(src.boundingRect3d().min(idx) - target.boundingRect3d().min(idx)) > prec)
         return false;
-      if(std::abs(srcLoop->boundingRect3d().max(idx) - targetLoop->boundingRect3d().max(idx)) > prec)
+      if(std::abs(src.boundingRect3d().max(idx) - target.boundingRect3d().max(idx)) > prec)
         return false;
 
-      QList<double> aPoints = loopPoints(srcLoop, idx, true);
-      QList<double> bPoints = loopPoints(targetLoop, idx, false);
-      int aCount = 0, bCount = 0;
+      return covers(src, target, idx, prec) || covers(target, src, idx, prec);
+    }
 
-      foreach(double a, aPoints) {
-        foreach(double b, bPoints) {
-          if(std::abs(a - b) < prec) {
-            aCount++;
-            break;
-          }
-        }
+    /**
+     * Index of loops by lower bounds of their 3d bounding boxes.
+     *
+     * For every perpendicular axis & every 3d axis it stores loops of views
+     * with that perpendicular axis sorted by their lower bound along the 3d
+     * axis. Matching loops have lower bounds within the precision of each
+     * other along their common axis, so candidates for a match form a
+     * contiguous range there. */
+    class LoopBoundIndex {
+    public:
+      LoopBoundIndex(const QList<Loop*>& loops) {
+        for(int i = 0; i < loops.size(); i++)
+          for(int axis = 0; axis < 3; axis++)
+            mEntries[loops[i]->view()->perpendicularAxisIndex()][axis].push_back(std::make_pair(loops[i]->boundingRect3d().min(axis), i));
+
+        for(int perpendicularAxis = 0; perpendicularAxis < 3; perpendicularAxis++)
+          for(int axis = 0; axis < 3; axis++)
+            std::sort(mEntries[perpendicularAxis][axis].begin(), mEntries[perpendicularAxis][axis].end());
       }
-/*
-      foreach(double b, bPoints) {
-        foreach(double a, aPoints) {
-          if(std::abs(a - b) < prec) {
-            bCount++;
-            break;
-          }
-        }
-      }*/
 
-      if(aCount == aPoints.size() || bCount == bPoints.size())
-        return true;
-
-      aPoints = loopPoints(srcLoop, idx, false);
-      bPoints = loopPoints(targetLoop, idx, true);
-/*      int aCount = 0, bCount = 0;
-
-      foreach(double a, aPoints) {
-        foreach(double b, bPoints) {
-          if(std::abs(a - b) < prec) {
-            aCount++;
-            break;
-          }
-        }
-      }*/
-
-      foreach(double b, bPoints) {
-        foreach(double a, aPoints) {
-          if(std::abs(a - b) < prec) {
-            bCount++;
-            break;
-          }
-        }
+      /**
+       * Appends to the result indices of loops of views with the given perpendicular axis whose lower bound along
+       * the given axis may lie within prec of the given value. The range is taken with some slack, so the caller
+       * is expected to recheck. */
+      void find(int perpendicularAxis, int axis, double value, double prec, std::vector<int>& result) const {
+        const std::vector<Entry>& entries = mEntries[perpendicularAxis][axis];
+        double hi = value + 2 * prec;
+        for(std::vector<Entry>::const_iterator pos = std::lower_bound(entries.begin(), entries.end(), std::make_pair(value - 2 * prec, -1)); pos != entries.end() && pos->first <= hi; ++pos)
+          result.push_back(pos->second);
       }
 
-      if(aCount == aPoints.size() || bCount == bPoints.size())
-        return true;
+    private:
+      typedef std::pair<double, int> Entry;
 
-      return false;
-    }
+      std::vector<Entry> mEntries[3][3];
+    };
 
     Vector3d to3d(const Vector2d& v) {
       return Vector3d(v.x(), v.y(), 0.0);
     }
 
 
-  } // namespace
-
-// -------------------------------------------------------------------------- //
-// LoopFormationConstructor
-// -------------------------------------------------------------------------- //
-  void LoopFormationConstructor::operator() () {
-    QList<Loop*> allLoops;
-    foreach(View* view, mViewBox->views())
-      allLoops.append(view->loops());
-
-    std::set<std::set<Loop*>> formationSet;
+    /** Formation candidate built from a single seed loop. */
+    struct Seed {
+      Seed(): formation(NULL) {
+        nonCone[0] = nonCone[1] = NULL;
+      }
 
-    foreach(Loop* aLoop, allLoops) {
-      LoopFormation* loopFormation = new LoopFormation();
-      loopFormation->addLoop(aLoop);
+      LoopFormation* formation;
+      Loop* nonCone[2]; /* Set of loops that is not to become a formation, if any. */
+    };
+
+    /**
+     * Builds formation candidates from seed loops.
+     *
+     * Only reads shared state, so it is safe to run it for different seeds
+     * concurrently. All the changes to the shared state are recorded in the
+     * seed, and are applied afterwards in seed order. */
+    class FormationSeeder {
+    public:
+      FormationSeeder(const QList<Loop*>& loops, const LoopBoundIndex& boundIndex, double prec, std::vector<Seed>& seeds):
+        mLoops(loops), mBoundIndex(boundIndex), mPrec(prec), mSeeds(seeds) {}
+
+      void operator() (int index) const {
+        Seed& seed = mSeeds[index];
+        Loop* aLoop = mLoops[index];
+        LoopFormation* loopFormation = new LoopFormation();
+        loopFormation->addLoop(aLoop);
+
+        /* matches() rejects loops with lower bounds that differ along the common axis,
+         * so only look at the loops that pass this test. Order of the candidates
+         * must be preserved, since it affects the formation being built. */
+        int aAxis = aLoop->view()->perpendicularAxisIndex();
+        std::vector<int> candidates;
+        for(int bAxis = 0; bAxis < 3; bAxis++)
+          if(bAxis != aAxis)
+            mBoundIndex.find(bAxis, 3 - aAxis - bAxis, aLoop->boundingRect3d().min(3 - aAxis - bAxis), mPrec, candidates);
+        std::sort(candidates.begin(), candidates.end());
       
-      foreach(Loop* bLoop, allLoops) {
-        if(aLoop->view()->perpendicularAxisIndex() == bLoop->view()->perpendicularAxisIndex())
-          continue;
+        foreach(int candidate, candidates) {
+          Loop* bLoop = mLoops[candidate];
 
-        bool empty = false;
-        foreach(Loop* fLoop, loopFormation->loops()) {
-          if(fLoop->view()->perpendicularAxisIndex() == bLoop->view()->perpendicularAxisIndex()) {
-            empty = true;
-            break;
-          }
+          bool empty = false;
+          foreach(Loop* fLoop, loopFormation->loops()) {
+            if(fLoop->view()->perpendicularAxisIndex() == bLoop->view()->perpendicularAxisIndex()) {
+              empty = true;
+              break;
+            }
 
-          int commonAxis = 3 - fLoop->view()->perpendicularAxisIndex() - bLoop->view()->perpendicularAxisIndex();
-          Rect1d bRect = bLoop->boundingRect3d().project(commonAxis);
-          Rect1d fRect = fLoop->boundingRect3d().project(commonAxis);
-          if(!bRect.intersectsOpen(fRect, mPrec)) { /* TODO: maybe isCoincident */
-            empty = true;
-            break;
+            int commonAxis = 3 - fLoop->view()->perpendicularAxisIndex() - bLoop->view()->perpendicularAxisIndex();
+            Rect1d bRect = bLoop->boundingRect3d().project(commonAxis);
+            Rect1d fRect = fLoop->boundingRect3d().project(commonAxis);
+            if(!bRect.intersectsOpen(fRect, mPrec)) { /* TODO: maybe isCoincident */
+              empty = true;
+              break;
+            }
           }
-        }
-        if(empty)
-          continue;
+          if(empty)
+            continue;
 
-        if(matches(aLoop, bLoop, mPrec))
-          loopFormation->addLoop(bLoop);
-      }
+          if(matches(aLoop, bLoop, mPrec))
+            loopFormation->addLoop(bLoop);
+        }
 
-      if(loopFormation->loops().size() < 2) {
-        delete loopFormation;
-        continue;
-      }
+        if(loopFormation->loops().size() < 2) {
+          delete loopFormation;
+          return;
+        }
 
-      /* Evil checking for cones. */
-      if(loopFormation->loops().size() >= 2) {
+        /* Evil checking for cones. */
+        if(loopFormation->loops().size() >= 2) {
 
-        Loop *circle = NULL, *trapezoid = NULL;
+          Loop *circle = NULL, *trapezoid = NULL;
 
-        foreach(Loop* loop, loopFormation->loops())
-          if(LoopUtils::isCircle(loop, mPrec))
-            circle = loop;
+          foreach(Loop* loop, loopFormation->loops())
+            if(LoopUtils::isCircle(loop, mPrec))
+              circle = loop;
 
-        foreach(Loop* loop, loopFormation->loops())
-          if(LoopUtils::isTrapezoid(loop, mPrec))
-            trapezoid = loop;
+          foreach(Loop* loop, loopFormation->loops())
+            if(LoopUtils::isTrapezoid(loop, mPrec))
+              trapezoid = loop;
 
-        /* TODO: >2 case not handled... */
+          /* TODO: >2 case not handled... */
 
-        if(circle != NULL && trapezoid != NULL) {
-          Vector2d center = circle->edge(0)->asArc().center();
-          foreach(Loop* loop, circle->view()->loops()) {
-            if(loop != circle && LoopUtils::isCircle(loop, mPrec) && (loop->edge(0)->asArc().center() - center).isZero(mPrec)) {
-              int commonAxis = 3 - circle->view()->perpendicularAxisIndex() - trapezoid->view()->perpendicularAxisIndex();
+          if(circle != NULL && trapezoid != NULL) {
+            Vector2d center = circle->edge(0)->asArc().center();
+            foreach(Loop* loop, circle->view()->loops()) {
+              if(loop != circle && LoopUtils::isCircle(loop, mPrec) && (loop->edge(0)->asArc().center() - center).isZero(mPrec)) {
+                int commonAxis = 3 - circle->view()->perpendicularAxisIndex() - trapezoid->view()->perpendicularAxisIndex();
               
-              Edge* edgeOne = NULL, *edgeTwo = NULL;
-
-              Rect1d circleOne = circle->boundingRect3d().project(commonAxis);
-              Rect1d circleTwo = loop->boundingRect3d().project(commonAxis);
-
-              Rect1d edge0 = trapezoid->edge(0)->boundingRect3d().project(commonAxis);
-              Rect1d edge1 = trapezoid->edge(1)->boundingRect3d().project(commonAxis);
-              Rect1d edge2 = trapezoid->edge(2)->boundingRect3d().project(commonAxis);
-              Rect1d edge3 = trapezoid->edge(3)->boundingRect3d().project(commonAxis);
-
-              if(circleOne.isCoincident(edge0, mPrec) && circleTwo.isCoincident(edge2, mPrec)) {
-                edgeOne = trapezoid->edge(0);
-                edgeTwo = trapezoid->edge(2);
-              } else if(circleOne.isCoincident(edge2, mPrec) && circleTwo.isCoincident(edge0, mPrec)) {
-                edgeOne = trapezoid->edge(2);
-                edgeTwo = trapezoid->edge(0);
-              } else if(circleOne.isCoincident(edge1, mPrec) && circleTwo.isCoincident(edge3, mPrec)) {
-                edgeOne = trapezoid->edge(1);
-                edgeTwo = trapezoid->edge(3);
-              } else if(circleOne.isCoincident(edge3, mPrec) && circleTwo.isCoincident(edge1, mPrec)) {
-                edgeOne = trapezoid->edge(3);
-                edgeTwo = trapezoid->edge(1);
+                Edge* edgeOne = NULL, *edgeTwo = NULL;
+
+                Rect1d circleOne = circle->boundingRect3d().project(commonAxis);
+                Rect1d circleTwo = loop->boundingRect3d().project(commonAxis);
+
+                Rect1d edge0 = trapezoid->edge(0)->boundingRect3d().project(commonAxis);
+                Rect1d edge1 = trapezoid->edge(1)->boundingRect3d().project(commonAxis);
+                Rect1d edge2 = trapezoid->edge(2)->boundingRect3d().project(commonAxis);
+                Rect1d edge3 = trapezoid->edge(3)->boundingRect3d().project(commonAxis);
+
+                if(circleOne.isCoincident(edge0, mPrec) && circleTwo.isCoincident(edge2, mPrec)) {
+                  edgeOne = trapezoid->edge(0);
+                  edgeTwo = trapezoid->edge(2);
+                } else if(circleOne.isCoincident(edge2, mPrec) && circleTwo.isCoincident(edge0, mPrec)) {
+                  edgeOne = trapezoid->edge(2);
+                  edgeTwo = trapezoid->edge(0);
+                } else if(circleOne.isCoincident(edge1, mPrec) && circleTwo.isCoincident(edge3, mPrec)) {
+                  edgeOne = trapezoid->edge(1);
+                  edgeTwo = trapezoid->edge(3);
+                } else if(circleOne.isCoincident(edge3, mPrec) && circleTwo.isCoincident(edge1, mPrec)) {
+                  edgeOne = trapezoid->edge(3);
+                  edgeTwo = trapezoid->edge(1);
+                }
+
+                if(edgeOne != NULL && edgeTwo != NULL) {
+                  /* Ignore non-cone set. */
+                  /* TODO: {loop, trapezoid} was meant to be ignored too, but never was. */
+                  seed.nonCone[0] = circle;
+                  seed.nonCone[1] = trapezoid;
+
+                  /* Mark as cone. */
+                  loopFormation->addLoop(loop);
+                  loopFormation->setClass(LoopFormation::CONE);
+
+                  LoopFormation::Cone& cone = loopFormation->asCone();
+                  cone.base = circle->view()->transform() * to3d(center);
+                  cone.base[circle->view()->perpendicularAxisIndex()] = edgeOne->boundingRect3d().min(circle->view()->perpendicularAxisIndex());
+                  cone.baseX = circle->view()->transform().linear() * to3d(Vector2d(0.0, 1.0) * circle->edge(0)->asArc().longAxis().norm());
+                  cone.baseY = circle->view()->transform().linear() * to3d(Vector2d(1.0, 0.0) * circle->edge(0)->asArc().longAxis().norm());
+                  cone.topX = loop->view()->transform().linear() * to3d(Vector2d(0.0, 1.0) * loop->edge(0)->asArc().longAxis().norm());
+                  cone.topY = loop->view()->transform().linear() * to3d(Vector2d(1.0, 0.0) * loop->edge(0)->asArc().longAxis().norm());
+                  cone.height = trapezoid->view()->transform().linear() * to3d(edgeTwo->boundingRect().center() - edgeOne->boundingRect().center());
+                  break;
+                }
+              }
+            }
+          }
+        }
+
+        /* Check for cylinders: a single circle and rectangles of the same
+         * width in the other views. */
+        if(loopFormation->clazz() == LoopFormation::NORMAL) {
+          Loop* circle = NULL;
+          int circleCount = 0, rectangleCount = 0;
+          foreach(Loop* loop, loopFormation->loops()) {
+            if(LoopUtils::isCircle(loop, mPrec)) {
+              circle = loop;
+              circleCount++;
+            } else if(LoopUtils::isRectangle(loop, mPrec)) {
+              rectangleCount++;
+            }
+          }
+
+          if(circleCount == 1 && rectangleCount == loopFormation->loops().size() - 1) {
+            int idx = circle->view()->perpendicularAxisIndex();
+            double lo = -std::numeric_limits<double>::max(), hi = std::numeric_limits<double>::max();
+
+            bool isCylinder = true;
+            foreach(Loop* loop, loopFormation->loops()) {
+              if(loop == circle)
+                continue;
+
+              if(loop->view()->perpendicularAxisIndex() == idx) {
+                isCylinder = false;
+                break;
               }
 
-              if(edgeOne != NULL && edgeTwo != NULL) {
-                /* Ignore non-cone set. */
-                std::set<Loop*> loopSet0;
-                loopSet0.insert(circle);
-                loopSet0.insert(trapezoid);
-                formationSet.insert(loopSet0);
-                std::set<Loop*> loopSet1;
-                loopSet0.insert(loop);
-                loopSet0.insert(trapezoid);
-                formationSet.insert(loopSet1);
-
-                /* Mark as cone. */
-                loopFormation->addLoop(loop);
-                loopFormation->setClass(LoopFormation::CONE);
-
-                LoopFormation::Cone& cone = loopFormation->asCone();
-                cone.base = circle->view()->transform() * to3d(center);
-                cone.base[circle->view()->perpendicularAxisIndex()] = edgeOne->boundingRect3d().min(circle->view()->perpendicularAxisIndex());
-                cone.baseX = circle->view()->transform().linear() * to3d(Vector2d(0.0, 1.0) * circle->edge(0)->asArc().longAxis().norm());
-                cone.baseY = circle->view()->transform().linear() * to3d(Vector2d(1.0, 0.0) * circle->edge(0)->asArc().longAxis().norm());
-                cone.topX = loop->view()->transform().linear() * to3d(Vector2d(0.0, 1.0) * loop->edge(0)->asArc().longAxis().norm());
-                cone.topY = loop->view()->transform().linear() * to3d(Vector2d(1.0, 0.0) * loop->edge(0)->asArc().longAxis().norm());
-                cone.height = trapezoid->view()->transform().linear() * to3d(edgeTwo->boundingRect().center() - edgeOne->boundingRect().center());
+              int commonAxis = 3 - idx - loop->view()->perpendicularAxisIndex();
+              if(!loop->boundingRect3d().project(commonAxis).isCoincident(circle->boundingRect3d().project(commonAxis), mPrec)) {
+                isCylinder = false;
                 break;
               }
+
+              lo = std::max(lo, loop->boundingRect3d().min(idx));
+              hi = std::min(hi, loop->boundingRect3d().max(idx));
+            }
+
+            if(isCylinder && lo < hi) {
+              loopFormation->setClass(LoopFormation::CYLINDER);
+
+              LoopFormation::Cylinder& cylinder = loopFormation->asCylinder();
+              cylinder.circle = circle;
+              cylinder.base = circle->view()->transform() * to3d(circle->edge(0)->asArc().center());
+              cylinder.base[idx] = lo;
+              cylinder.height = Vector3d::Zero();
+              cylinder.height[idx] = hi - lo;
             }
           }
         }
+
+        seed.formation = loopFormation;
       }
 
+    private:
+      const QList<Loop*>& mLoops;
+      const LoopBoundIndex& mBoundIndex;
+      double mPrec;
+      std::vector<Seed>& mSeeds;
+    };
+
+  } // namespace
+
+// -------------------------------------------------------------------------- //
+// LoopFormationConstructor
+// -------------------------------------------------------------------------- //
+  void LoopFormationConstructor::operator() () {
+    QList<Loop*> allLoops;
+    foreach(View* view, mViewBox->views()) {
+      view->freezeLoops();
+      allLoops.append(view->loops());
+    }
+
+    FingerprintSet<Loop> formationSet;
+
+    LoopBoundIndex boundIndex(allLoops);
+
+    /* Build formation candidates for all seed loops in parallel. */
+    std::vector<Seed> seeds(allLoops.size());
+    parallelFor(allLoops.size(), FormationSeeder(allLoops, boundIndex, mPrec, seeds));
+
+    /* Filter them in seed order. */
+    for(int i = 0; i < allLoops.size(); i++) {
+      LoopFormation* loopFormation = seeds[i].formation;
+      if(loopFormation == NULL)
+        continue;
+
+      if(seeds[i].nonCone[0] != NULL)
+        formationSet.insert(seeds[i].nonCone, seeds[i].nonCone + 2);
 
       bool hasDisjoint = false;
       foreach(Loop* loop, loopFormation->loops())
@@ -233,14 +354,11 @@ namespace qr {
       }
 
       /* Check for duplicates. */
-      std::set<Loop*> loopSet;
-      foreach(Loop* loop, loopFormation->loops())
-        loopSet.insert(loop);
-      if(formationSet.find(loopSet) != formationSet.end()) {
+      QList<Loop*> formationLoops = loopFormation->loops();
+      if(!formationSet.insert(formationLoops.begin(), formationLoops.end())) {
         delete loopFormation;
         continue;
       }
-      formationSet.insert(loopSet);
 
       mViewBox->addLoopFormation(loopFormation);
 
@@ -250,14 +368,15 @@ namespace qr {
           edge->setPen(QPen(color));*/
     }
 
-    /* Add bound-on-solid if needed. */
-    std::set<Loop*> boundOnSolid;
+    /* Add bound-on-solid if needed. Views with open contours have no outer loop. */
+    QList<Loop*> boundOnSolid;
     foreach(View* view, mViewBox->views())
-      boundOnSolid.insert(view->outerLoop());
-    if(formationSet.find(boundOnSolid) == formationSet.end()) {
+      if(view->outerLoop() != NULL)
+        boundOnSolid.push_back(view->outerLoop());
+    if(boundOnSolid.size() == mViewBox->views().size() && !formationSet.contains(boundOnSolid.begin(), boundOnSolid.end())) {
       LoopFormation* loopFormation = new LoopFormation();
-      foreach(View* view, mViewBox->views())
-        loopFormation->addLoop(view->outerLoop());
+      foreach(Loop* loop, boundOnSolid)
+        loopFormation->addLoop(loop);
       mViewBox->addLoopFormation(loopFormation);
     }
 
@@ -304,7 +423,7 @@ namespace qr {
 
       /* If all vertices of target loop are on outer loop & merge successful then it's protrusion. */
       foreach(Loop* loop, loopFormation->loops()) {
-        if(loop->view()->outerLoop()->vertexSet().contains(loop->vertexSet())) {
+        if(loop->view()->outerLoop() != NULL && loop->view()->outerLoop()->vertexSet().contains(loop->vertexSet())) {
           Loop* merge = LoopMerger(loop, loop->view()->outerLoop())();
           if(merge != NULL) {
             delete merge;
@@ -1,151 +1,93 @@
 #include "LoopFormationExtruder.h"
-#include <algorithm> /* for std::random_shuffle() */
+#include <algorithm> /* for std::random_shuffle(), std::sort(), std::stable_sort(), std::min(), std::max() */
 #include <iterator> /* for std::back_inserter() */
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cassert>
 #include <boost/foreach.hpp>
-#include <QSet>
+#include <Eigen/StdVector>
+#include <QAtomicInt>
+#include <QHash>
+#include <QPair>
+#include <QVector>
 #include <carve/csg.hpp>
 #include <carve/tree.hpp>
-#include <carve/input.hpp>
-#include "LoopExtruder.h"
 #include "Debug.h"
 #include "View.h"
 #include "LoopUtils.h"
 #include "ViewBox.h"
+#include "Fingerprint.h"
+#include "Parallel.h"
+#include "Tessellation.h"
+#include "CarveLock.h"
 
 namespace qr {
   namespace { 
-    carve::geom::vector<3> toVECTOR(const Vector3d& v) {
-      return carve::geom::VECTOR(v.x(), v.y(), v.z());
-    }
-
     Vector3d to3d(const Vector2d& v) {
       return Vector3d(v.x(), v.y(), 0.0);
     }
 
-    Vector3d spherePoint(const Vector3d& center, double radius, double phi, double psi) {
-      return center + radius * Vector3d(cos(phi) * cos(psi), sin(phi) * cos(psi), sin(psi));
-    }
-
-    carve::poly::Polyhedron* genSphere(const Vector3d& center, double radius) {
-      carve::input::PolyhedronData data;
-
-      const int STACKS = 16;
-      const int SLICES = 32;
-
-      for(int j = 0; j < STACKS - 1; j++)
-        for(int i = 0; i < SLICES; i++)
-          data.addVertex(toVECTOR(spherePoint(center, radius, i * 2 * M_PI / SLICES, (j + 1) * M_PI / STACKS - M_PI / 2)));
-      data.addVertex(toVECTOR(spherePoint(center, radius, 0, -M_PI / 2)));
-      data.addVertex(toVECTOR(spherePoint(center, radius, 0, M_PI / 2)));
-
-      int n = data.points.size() - 2;
-
-      for(int i = 0; i < SLICES; i++) {
-        data.addFace(n, (i + 1) % SLICES, i);
-        data.addFace(n + 1, n - 1 - (i + 1) % SLICES, n - 1 - i);
-      }
-
-      for(int j = 0; j < STACKS - 2; j++) {
-        for(int i = 0; i < SLICES; i++) {
-          int i1 = (i + 1) % SLICES;
-          int j1 = j + 1;
-          data.addFace(j * SLICES + i, j * SLICES + i1, j1 * SLICES + i1, j1 * SLICES + i);
+    typedef PrimitiveCache::Polygon Polygon;
+
+    /**
+     * Circle of the cylinder is tessellated just like in its extrusion, so
+     * that the result matches the intersection of the formation's prisms.
+     *
+     * @returns                        Tessellated cylinder. */
+    carve::poly::Polyhedron* genCylinder(const LoopFormation::Cylinder& cylinder, const Tessellation& tessellation, PrimitiveCache& primitives) {
+      Loop* circle = cylinder.circle;
+      int idx = circle->view()->perpendicularAxisIndex();
+
+      Polygon polygon;
+      Tessellation::PointVector points;
+      foreach(const LoopVertex& loopVertex, circle->vertices()) {
+        Edge* edge = loopVertex.nextEdge();
+        bool forward = edge->vertex(0) == loopVertex.vertex();
+
+        points.clear();
+        tessellation.arcPoints(edge->asArc(), points);
+        int segmentCount = static_cast<int>(points.size()) - 1;
+
+        int start = forward ? 0 : segmentCount;
+        int delta = forward ? 1 : -1;
+
+        for(int i = 0; i < segmentCount; i++) {
+          Vector3d v = circle->view()->transform() * to3d(points[start + i * delta]);
+          v[idx] = cylinder.base[idx];
+          polygon.push_back(v - cylinder.base);
         }
       }
 
-      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
-      result->canonicalize();
-      return result;
+      return primitives.prism(cylinder.base, cylinder.height, polygon);
     }
 
-    carve::poly::Polyhedron* genCone(const Vector3d& base, const Vector3d& height, const Vector3d& baseX, const Vector3d& baseY, const Vector3d& topX, const Vector3d& topY) {
-      if(baseX.cross(baseY).dot(height) < 0)
-        return genCone(base + height, -height, topX, topY, baseX, baseY);
-
-      carve::input::PolyhedronData data;
+    /** Triangle spanned by the center of an arc and its endpoints, a to b counterclockwise. */
+    struct Wedge {
+      Vector3d a, b;
+      double angle;
 
-      const int SLICES = 32;
-
-      for(int i = 0; i < SLICES; i++) {
-        float a = i * 2 * M_PI / SLICES;
-        data.addVertex(toVECTOR(base +          baseX * cos(a) + baseY * sin(a)));
-        data.addVertex(toVECTOR(base + height + topX * cos(a) + topY * sin(a)));
+      bool operator< (const Wedge& other) const {
+        return angle < other.angle;
       }
-
-      /* Add side faces. */
-      for(int i = 0; i < SLICES; i++)
-        data.addFace(i * 2 + 1, i * 2, (i * 2 + 2) % (SLICES * 2), (i * 2 + 3) % (SLICES * 2));
-
-      /* Add basement faces. */
-      std::vector<int> face;
-      face.resize(SLICES);
-      for(int i = 0; i < SLICES; i++)
-        face[i] = 2 * (SLICES - 1) - i * 2;
-      data.addFace(face.begin(), face.end());
-      for(int i = 0; i < SLICES; i++)
-        face[i] = i * 2 + 1;
-      data.addFace(face.begin(), face.end());
-
-      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
-      result->canonicalize();
-      return result;
-    }
-
-    carve::poly::Polyhedron* genBox(const Rect3d& rect) {
-      carve::input::PolyhedronData data;
-
-      data.addVertex(carve::geom::VECTOR(rect.min(0), rect.min(1), rect.min(2)));
-      data.addVertex(carve::geom::VECTOR(rect.min(0), rect.min(1), rect.max(2)));
-      data.addVertex(carve::geom::VECTOR(rect.min(0), rect.max(1), rect.min(2)));
-      data.addVertex(carve::geom::VECTOR(rect.min(0), rect.max(1), rect.max(2)));
-      data.addVertex(carve::geom::VECTOR(rect.max(0), rect.min(1), rect.min(2)));
-      data.addVertex(carve::geom::VECTOR(rect.max(0), rect.min(1), rect.max(2)));
-      data.addVertex(carve::geom::VECTOR(rect.max(0), rect.max(1), rect.min(2)));
-      data.addVertex(carve::geom::VECTOR(rect.max(0), rect.max(1), rect.max(2)));
-
-      data.addFace(0, 1, 3, 2);
-      data.addFace(7, 5, 4, 6);
-      data.addFace(0, 2, 6, 4);
-      data.addFace(2, 3, 7, 6);
-      data.addFace(3, 1, 5, 7);
-      data.addFace(1, 0, 4, 5);
-      
-      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
-      result->canonicalize();
-      return result;
-    }
-
-    carve::poly::Polyhedron* genPrism(const Vector3d& origin, const Vector3d& height, const Vector3d& a, const Vector3d& b) {
-      if(a.cross(b).dot(height) < 0)
-        return genPrism(origin, height, b, a);
-
-      carve::input::PolyhedronData data;
-
-      data.addVertex(toVECTOR(origin));
-      data.addVertex(toVECTOR(origin + a));
-      data.addVertex(toVECTOR(origin + b));
-      data.addVertex(toVECTOR(origin + height));
-      data.addVertex(toVECTOR(origin + height + a));
-      data.addVertex(toVECTOR(origin + height + b));
-
-      data.addFace(2, 1, 0);
-      data.addFace(0, 3, 5, 2);
-      data.addFace(2, 5, 4, 1);
-      data.addFace(1, 4, 3, 0);
-      data.addFace(3, 4, 5);
-
-      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
-      result->canonicalize();
-      return result;
-    }
-
-    carve::poly::Polyhedron* genArcWrapper(const QSet<Edge*>& edges) {
+    };
+
+    /**
+     * Arc wrapper is the union of prisms over the triangles spanned by the
+     * common center and the (scaled) endpoints of each arc.
+     *
+     * The triangles are sorted by angle and chained into fans by their shared
+     * endpoints, and each fan is built as a single prism. Arcs that close the
+     * circle form a fan without the center. */
+    carve::poly::Polyhedron* genArcWrapper(const std::vector<Edge*>& edges, PrimitiveCache& primitives) {
       assert(!edges.empty());
       foreach(Edge* edge, edges)
         assert(edge->type() == Edge::ARC && (edge->asArc().center() - (*edges.begin())->asArc().center()).isZero(1.0e-6)); /* TODO: EPS */
 
       Edge* edge = *edges.begin();
       int idx = edge->view()->perpendicularAxisIndex();
+      int idx0 = (idx + 1) % 3;
+      int idx1 = (idx + 2) % 3;
       double lo = edge->view()->viewBox()->boundingRect().min(idx);
       double hi = edge->view()->viewBox()->boundingRect().max(idx);
       
@@ -155,16 +97,61 @@ namespace qr {
       Vector3d origin = edge->view()->transform() * to3d(edge->asArc().center());
       origin[idx] = lo;
 
-      carve::poly::Polyhedron* result = NULL;
+      std::vector<Wedge> wedges;
       foreach(Edge* edge, edges) {
-        Vector3d a = edge->vertex(0)->pos3d();
-        Vector3d b = edge->vertex(1)->pos3d();
-        a[idx] = lo;
-        b[idx] = lo;
-        a = a - origin;
-        b = b - origin;
-
-        carve::poly::Polyhedron* poly = genPrism(origin - height, 3 * height, 3 * a, 3 * b);
+        Wedge wedge;
+        wedge.a = edge->vertex(0)->pos3d();
+        wedge.b = edge->vertex(1)->pos3d();
+        wedge.a[idx] = lo;
+        wedge.b[idx] = lo;
+        wedge.a = 3 * (wedge.a - origin);
+        wedge.b = 3 * (wedge.b - origin);
+        if(wedge.a[idx0] * wedge.b[idx1] - wedge.a[idx1] * wedge.b[idx0] < 0)
+          std::swap(wedge.a, wedge.b);
+        wedge.angle = atan2(wedge.a[idx1], wedge.a[idx0]);
+        wedges.push_back(wedge);
+      }
+      std::sort(wedges.begin(), wedges.end());
+
+      /* Link wedges that share endpoints. */
+      int n = static_cast<int>(wedges.size());
+      std::vector<int> next(n, -1);
+      std::vector<bool> hasPrev(n, false);
+      for(int i = 0; i < n; i++) {
+        for(int j = 0; j < n; j++) {
+          if(i != j && !hasPrev[j] && (wedges[i].b - wedges[j].a).isZero(1.0e-6)) { /* TODO: EPS */
+            next[i] = j;
+            hasPrev[j] = true;
+            break;
+          }
+        }
+      }
+
+      /* Collect fans, open ones first, then closed ones. */
+      QList<Polygon> polygons;
+      std::vector<bool> used(n, false);
+      for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < n; i++) {
+          if(used[i] || (pass == 0 && hasPrev[i]))
+            continue;
+
+          Polygon polygon;
+          if(pass == 0)
+            polygon.push_back(Vector3d::Zero());
+          polygon.push_back(wedges[i].a);
+          for(int j = i; j != -1 && !used[j]; j = next[j]) {
+            used[j] = true;
+            if(pass == 0 || next[j] != i)
+              polygon.push_back(wedges[j].b);
+          }
+          polygons.push_back(polygon);
+        }
+      }
+
+      /* Disjoint fans only touch at the center, so they still have to be united. */
+      carve::poly::Polyhedron* result = NULL;
+      foreach(const Polygon& polygon, polygons) {
+        carve::poly::Polyhedron* poly = primitives.prism(origin - height, 3 * height, polygon);
         if(result == NULL) {
           result = poly;
         } else {
@@ -173,6 +160,7 @@ namespace qr {
           carve::csg::CSG::OP op = carve::csg::CSG::UNION;
           carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
 
+          CarveLock locker;
           carve::csg::CSG csg;
           result = node->eval(csg);
           result->canonicalize();
@@ -182,6 +170,223 @@ namespace qr {
       return result;
     }
 
+    /** Deterministic random number generator for std::random_shuffle(). */
+    class ShuffleRandom {
+    public:
+      ShuffleRandom(quint64 seed): mState(seed) {}
+
+      /** @returns                     Random number in [0, n). */
+      int operator() (int n) {
+        mState = mState * Q_UINT64_C(6364136223846793005) + Q_UINT64_C(1442695040888963407);
+        return static_cast<int>((mState >> 33) % static_cast<quint64>(n));
+      }
+
+    private:
+      quint64 mState;
+    };
+
+    /** Orders loops by the given volumes of their prisms' bounding boxes. */
+    class VolumeLess {
+    public:
+      VolumeLess(const QHash<Loop*, double>& volumes): mVolumes(volumes) {}
+
+      bool operator() (Loop* a, Loop* b) const {
+        return mVolumes.value(a) < mVolumes.value(b);
+      }
+
+    private:
+      const QHash<Loop*, double>& mVolumes;
+    };
+
+    /** Range of extrusion along the perpendicular axis of a loop. */
+    struct Depth {
+      Depth(): min(-std::numeric_limits<double>::max()), max(std::numeric_limits<double>::max()) {}
+
+      double min, max;
+    };
+
+    /**
+     * The solid of a formation lies within the extrusions of all its loops, so
+     * along the extrusion axis of a loop it is bounded by the extents of the
+     * loops from the views that cross it.
+     *
+     * @returns                        Depth range of the given loop within the formation. */
+    Depth depthOf(Loop* loop, const QList<Loop*>& loops) {
+      Depth result;
+      int idx = loop->view()->perpendicularAxisIndex();
+      foreach(Loop* otherLoop, loops) {
+        if(otherLoop->view()->perpendicularAxisIndex() == idx)
+          continue;
+
+        result.min = std::max(result.min, otherLoop->boundingRect3d().min(idx));
+        result.max = std::min(result.max, otherLoop->boundingRect3d().max(idx));
+      }
+      return result;
+    }
+
+    /**
+     * Evaluates intersection of extruded loops for one of the given loop
+     * orderings. Attempts for different orderings can be run concurrently, an
+     * attempt is skipped if one for an earlier ordering has already succeeded. */
+    class IntersectionAttempt {
+    public:
+      IntersectionAttempt(const std::vector<QList<Loop*> >& orderings, const QHash<Loop*, Depth>& depths, LoopExtrusionCache& cache, std::vector<carve::poly::Polyhedron*>& results, QAtomicInt& firstSuccess):
+        mOrderings(orderings), mDepths(depths), mCache(cache), mResults(results), mFirstSuccess(firstSuccess) {}
+
+      void operator() (int index) const {
+        if(mFirstSuccess < index)
+          return;
+
+        carve::csg::CSG_TreeNode* node = NULL;
+        foreach(Loop* loop, mOrderings[index]) {
+          Depth depth = mDepths.value(loop);
+          carve::poly::Polyhedron* extrudedLoop = mCache.extrude(loop, depth.min, depth.max);
+          if(node == NULL)
+            node = new carve::csg::CSG_PolyNode(extrudedLoop, true);
+          else
+            node = new carve::csg::CSG_OPNode(new carve::csg::CSG_PolyNode(extrudedLoop, true), node, carve::csg::CSG::INTERSECTION, true);
+          //debugSavePoly(extrudedLoop, carve::csg::CSG::INTERSECTION);
+        }
+
+        try {
+          CarveLock locker;
+          carve::csg::CSG csg;
+          mResults[index] = node->eval(csg);
+        } catch (carve::exception&) {
+          delete node;
+          return;
+        }
+        delete node;
+
+        while(true) {
+          int firstSuccess = mFirstSuccess;
+          if(firstSuccess <= index || mFirstSuccess.testAndSetOrdered(firstSuccess, index))
+            break;
+        }
+      }
+
+    private:
+      const std::vector<QList<Loop*> >& mOrderings;
+      const QHash<Loop*, Depth>& mDepths;
+      LoopExtrusionCache& mCache;
+      std::vector<carve::poly::Polyhedron*>& mResults;
+      QAtomicInt& mFirstSuccess;
+    };
+
+    qint64 bucket(double value, double step) {
+      return static_cast<qint64>(std::floor(value / step));
+    }
+
+    /**
+     * Index of arc edges of a single loop, for sphere detection.
+     *
+     * Arcs are bucketed by pairs of values with twice the precision as a step,
+     * so all arcs matching a query within the precision lie in its bucket or
+     * in the neighbouring ones. Queries return arcs in loop order. */
+    class LoopArcIndex {
+    public:
+      struct Arc {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+        Edge* edge;
+        Vector2d center;
+        Vector3d center3d;
+        double radius;
+      };
+
+      LoopArcIndex(Loop* loop, double prec): mIdx(loop->view()->perpendicularAxisIndex()), mPrec(prec), mStep(2 * prec) {
+        foreach(Edge* edge, loop->edges()) {
+          if(edge->type() != Edge::ARC)
+            continue;
+
+          Arc arc;
+          arc.edge = edge;
+          arc.center = edge->asArc().center();
+          arc.center3d = loop->view()->transform() * to3d(arc.center);
+          arc.radius = edge->asArc().longAxis().norm();
+
+          int index = static_cast<int>(mArcs.size());
+          mCenterBuckets.insert(key(arc.center[0], arc.center[1]), index);
+          mCenter3dBuckets.insert(key(arc.center3d[(mIdx + 1) % 3], arc.center3d[(mIdx + 2) % 3]), index);
+          for(int axis = 0; axis < 3; axis++)
+            if(axis != mIdx)
+              mRadiusBuckets[axis].insert(key(arc.radius, arc.center3d[axis]), index);
+          mArcs.push_back(arc);
+        }
+      }
+
+      int size() const {
+        return static_cast<int>(mArcs.size());
+      }
+
+      const Arc& arc(int index) const {
+        return mArcs[index];
+      }
+
+      /** @returns                     Indices of arcs with centers within the precision of the given one. */
+      void findByCenter(const Vector2d& center, QVector<int>& result) const {
+        candidates(mCenterBuckets, center[0], center[1], result);
+
+        int size = 0;
+        for(int i = 0; i < result.size(); i++)
+          if((mArcs[result[i]].center - center).isZero(mPrec))
+            result[size++] = result[i];
+        result.resize(size);
+      }
+
+      /** @returns                     Indices of arcs with the given radius and the given center coordinate along the given in-plane axis. */
+      void findByRadius(double radius, int axis, double coordinate, QVector<int>& result) const {
+        assert(axis != mIdx);
+
+        candidates(mRadiusBuckets[axis], radius, coordinate, result);
+
+        int size = 0;
+        for(int i = 0; i < result.size(); i++)
+          if(!(std::abs(mArcs[result[i]].radius - radius) > mPrec) && !(std::abs(mArcs[result[i]].center3d[axis] - coordinate) > mPrec))
+            result[size++] = result[i];
+        result.resize(size);
+      }
+
+      /** @returns                     Indices of arcs with 3d centers matching the given point along both in-plane axes. */
+      void findByCenter3d(const Vector3d& point, QVector<int>& result) const {
+        candidates(mCenter3dBuckets, point[(mIdx + 1) % 3], point[(mIdx + 2) % 3], result);
+
+        int size = 0;
+        for(int i = 0; i < result.size(); i++) {
+          Vector3d delta = mArcs[result[i]].center3d - point;
+          delta[mIdx] = 0.0;
+          if(delta.isZero(mPrec))
+            result[size++] = result[i];
+        }
+        result.resize(size);
+      }
+
+    private:
+      typedef QPair<qint64, qint64> Key;
+
+      Key key(double a, double b) const {
+        return Key(bucket(a, mStep), bucket(b, mStep));
+      }
+
+      void candidates(const QMultiHash<Key, int>& buckets, double a, double b, QVector<int>& result) const {
+        result.clear();
+        Key center = key(a, b);
+        for(qint64 i = center.first - 1; i <= center.first + 1; i++) {
+          for(qint64 j = center.second - 1; j <= center.second + 1; j++) {
+            Key k(i, j);
+            for(QMultiHash<Key, int>::const_iterator pos = buckets.find(k); pos != buckets.end() && pos.key() == k; ++pos)
+              result.push_back(*pos);
+          }
+        }
+        std::sort(result.begin(), result.end());
+      }
+
+      int mIdx;
+      double mPrec, mStep;
+      std::vector<Arc, Eigen::aligned_allocator<Arc> > mArcs;
+      QMultiHash<Key, int> mCenterBuckets, mCenter3dBuckets, mRadiusBuckets[3];
+    };
+
   } // namespace
 
 // -------------------------------------------------------------------------- //
@@ -189,6 +394,7 @@ namespace qr {
 // -------------------------------------------------------------------------- //
   carve::poly::Polyhedron* LoopFormationExtruder::operator() () {
     carve::poly::Polyhedron* result = NULL;
+    Tessellation tessellation = Tessellation::forPart(mLoopFormation->loop(0)->view()->viewBox()->boundingRect());
 
     /* TODO: we better move this to LoopFormationConstructor and add Class enum to LoopFormation (i.e. NORMAL, SPHERE, etc...) */
     if(LoopUtils::isSphere(mLoopFormation, 1.0e-6)) { /* TODO: EPS */
@@ -206,10 +412,10 @@ namespace qr {
 
       double radius = mLoopFormation->loop(0)->edge(0)->asArc().longAxis().norm();
 
-      result = genSphere(center, radius);
+      result = mPrimitives.sphere(center, radius, tessellation);
     } else if(mLoopFormation->clazz() == LoopFormation::CONE) {
       const LoopFormation::Cone& cone = mLoopFormation->asCone();
-      result = genCone(cone.base, cone.height, cone.baseX, cone.baseY, cone.topX, cone.topY);
+      result = mPrimitives.cone(cone.base, cone.height, cone.baseX, cone.baseY, cone.topX, cone.topY, tessellation);
 
       if(mLoopFormation->type() == LoopFormation::PROTRUSION) {
         Rect3d rect;
@@ -218,39 +424,82 @@ namespace qr {
         rect.extend(cone.base + cone.height - cone.topX - cone.topY);
         rect.extend(cone.base + cone.height + cone.topX + cone.topY);
 
-        carve::poly::Polyhedron* outerPoly = genBox(rect);
+        carve::poly::Polyhedron* outerPoly = mPrimitives.box(rect);
 
         mSubtractions.push_back(outerPoly);
         mAdditions.push_back(result);
         result = NULL;
       }
+    } else if(mLoopFormation->clazz() == LoopFormation::CYLINDER) {
+      result = genCylinder(mLoopFormation->asCylinder(), tessellation, mPrimitives);
     } else {
       QList<Loop*> loops;
       std::copy(mLoopFormation->loops().begin(), mLoopFormation->loops().end(), std::back_inserter(loops));
 
+      /* Extrude loops only as deep as the formation goes. */
+      QHash<Loop*, Depth> depths;
+      foreach(Loop* loop, loops)
+        depths.insert(loop, depthOf(loop, loops));
+
+      /* Prisms with disjoint bounding boxes have an empty intersection, no
+       * need to evaluate it, nor to build the sphere pieces that would be
+       * applied to it. Pieces of a protrusion go to the object itself, so
+       * these are built anyway. */
+      bool isEmpty = false;
+      for(int i = 0; i < loops.size() && !isEmpty; i++)
+        for(int j = i + 1; j < loops.size() && !isEmpty; j++)
+          if(CsgCuller::isDisjoint(mCache.boundingRect(loops[i], depths[loops[i]].min, depths[loops[i]].max), mCache.boundingRect(loops[j], depths[loops[j]].min, depths[loops[j]].max)))
+            isEmpty = true;
+
+      /* A box prism that contains the bounding box of another prism does not
+       * change the intersection. Depths were computed for the whole formation,
+       * so dropping it changes no other prism either. */
+      if(!isEmpty) {
+        for(int i = 0; i < loops.size() && loops.size() > 1;) {
+          bool isContaining = false;
+          if(mCache.isBox(loops[i], depths[loops[i]].min, depths[loops[i]].max)) {
+            Rect3d rect = mCache.boundingRect(loops[i], depths[loops[i]].min, depths[loops[i]].max);
+            for(int j = 0; j < loops.size() && !isContaining; j++)
+              if(j != i && CsgCuller::contains(rect, mCache.boundingRect(loops[j], depths[loops[j]].min, depths[loops[j]].max)))
+                isContaining = true;
+          }
+
+          if(isContaining) {
+            loops.removeAt(i);
+            mCuller.skip();
+          } else {
+            i++;
+          }
+        }
+      }
+
       QList<carve::poly::Polyhedron*> subtractions, additions;
 
-      /* Find potential spheres. */
-      std::set<std::set<Edge*>> spheres;
-      foreach(Loop* loop, mLoopFormation->loops()) {
-        QSet<Edge*> usedEdges;
+      /* Find potential spheres. Arcs are indexed once, so that matching arcs
+       * of other loops are looked up instead of enumerated. */
+      QHash<Loop*, LoopArcIndex*> arcIndices;
+      foreach(Loop* loop, mLoopFormation->loops())
+        arcIndices.insert(loop, new LoopArcIndex(loop, 1.0e-6)); /* TODO: EPS */
 
-        foreach(Edge* edge, loop->edges()) {
-          if(edge->type() != Edge::ARC)
-            continue;
+      FingerprintSet<Edge> spheres;
+      std::vector<Edge*> sphere;
+      QVector<int> found, otherFound;
+      foreach(Loop* loop, mLoopFormation->loops()) {
+        const LoopArcIndex& index = *arcIndices[loop];
+        std::vector<bool> usedArcs(index.size(), false);
 
-          if(usedEdges.contains(edge))
+        for(int e = 0; e < index.size(); e++) {
+          if(usedArcs[e])
             continue;
 
-          Vector2d center = edge->asArc().center();
-          Vector3d center3d = loop->view()->transform() * to3d(edge->asArc().center());
+          Edge* edge = index.arc(e).edge;
+          Vector3d center3d = index.arc(e).center3d;
 
-          QSet<Edge*> edges;
-          foreach(Edge* otherEdge, loop->edges()) {
-            if(otherEdge->type() == Edge::ARC && (otherEdge->asArc().center() - center).isZero(1.0e-6)) { /* TODO: EPS */
-              edges.insert(otherEdge);
-              usedEdges.insert(otherEdge);
-            }
+          std::vector<Edge*> edges;
+          index.findByCenter(index.arc(e).center, found);
+          foreach(int i, found) {
+            edges.push_back(index.arc(i).edge);
+            usedArcs[i] = true;
           }
 
           foreach(Loop* otherLoop, mLoopFormation->loops()) {
@@ -262,40 +511,31 @@ namespace qr {
 
             int idx = 3 - loop->view()->perpendicularAxisIndex() - otherLoop->view()->perpendicularAxisIndex();
 
-            QSet<Edge*> usedOtherEdges;
-            foreach(Edge* otherEdge, otherLoop->edges()) {
-              if(otherEdge->type() != Edge::ARC)
-                continue;
+            const LoopArcIndex& otherIndex = *arcIndices[otherLoop];
+            std::vector<bool> usedOtherArcs(otherIndex.size(), false);
 
-              if(usedOtherEdges.contains(otherEdge))
+            otherIndex.findByRadius(index.arc(e).radius, idx, center3d[idx], otherFound);
+            foreach(int o, otherFound) {
+              if(usedOtherArcs[o])
                 continue;
 
-              if(std::abs(otherEdge->asArc().longAxis().norm() - edge->asArc().longAxis().norm()) > 1.0e-6) /* TODO: EPS */
-                continue;
+              Vector3d otherCenter3d = otherIndex.arc(o).center3d;
 
-              Vector2d otherCenter = otherEdge->asArc().center();
-              Vector3d otherCenter3d = otherLoop->view()->transform() * to3d(otherCenter);
-
-              if(std::abs(center3d[idx] - otherCenter3d[idx]) > 1.0e-6) /* TODO: EPS */
-                continue;
-
-              QSet<Edge*> otherEdges;
-              foreach(Edge* anotherEdge, otherLoop->edges()) {
-                if(anotherEdge->type() == Edge::ARC && (anotherEdge->asArc().center() - otherCenter).isZero(1.0e-6)) { /* TODO: EPS */
-                  otherEdges.insert(anotherEdge);
-                  usedOtherEdges.insert(anotherEdge);
-                }
+              std::vector<Edge*> otherEdges;
+              otherIndex.findByCenter(otherIndex.arc(o).center, found);
+              foreach(int i, found) {
+                otherEdges.push_back(otherIndex.arc(i).edge);
+                usedOtherArcs[i] = true;
               }
 
               /* Here edges & otherEdges form a spherical surface. */
 
               /* Check for duplicates. */
-              std::set<Edge*> sphere;
-              std::copy(edges.begin(), edges.end(), std::inserter(sphere, sphere.begin()));
-              std::copy(otherEdges.begin(), otherEdges.end(), std::inserter(sphere, sphere.begin()));
-              if(spheres.find(sphere) != spheres.end())
+              sphere.clear();
+              std::copy(edges.begin(), edges.end(), std::back_inserter(sphere));
+              std::copy(otherEdges.begin(), otherEdges.end(), std::back_inserter(sphere));
+              if(!spheres.insert(sphere.begin(), sphere.end()))
                 continue;
-              spheres.insert(sphere);
 
               /* Get center & radius. */                           
               Vector3d sphereCenter = center3d;
@@ -311,35 +551,29 @@ namespace qr {
                 if(lastLoop == loop || lastLoop == otherLoop)
                   lastLoop = mLoopFormation->loop(2);
 
-                bool hasLast = false;
-                foreach(Edge* edge, lastLoop->edges()) {
-                  if(edge->type() != Edge::ARC)
-                    continue;
-
-                  Vector3d lastCenter = lastLoop->view()->transform() * to3d(edge->asArc().center());
-
-                  lastCenter[lastLoop->view()->perpendicularAxisIndex()] = sphereCenter[lastLoop->view()->perpendicularAxisIndex()];
-
-                  if((lastCenter - sphereCenter).isZero(1.0e-6)) { /* TODO: EPS */
-                    hasLast = true;
-                    sphere.insert(edge);
-                  }
-                }
-                if(!hasLast)
+                arcIndices[lastLoop]->findByCenter3d(sphereCenter, found);
+                foreach(int i, found)
+                  sphere.push_back(arcIndices[lastLoop]->arc(i).edge);
+                if(found.empty())
                   continue;
 
-                if(spheres.find(sphere) != spheres.end())
+                if(!spheres.insert(sphere.begin(), sphere.end()))
                   continue;
-                spheres.insert(sphere);
               }
 
-              carve::poly::Polyhedron* firstWrapper = genArcWrapper(edges);
-              carve::poly::Polyhedron* secondWrapper = genArcWrapper(otherEdges);
+              /* Subtraction and addition of this sphere to an empty result. */
+              if(isEmpty && mLoopFormation->type() == LoopFormation::DEPRESSION) {
+                mCuller.skip(2);
+                continue;
+              }
+
+              carve::poly::Polyhedron* firstWrapper = genArcWrapper(edges, mPrimitives);
+              carve::poly::Polyhedron* secondWrapper = genArcWrapper(otherEdges, mPrimitives);
 
               //debugShowPoly(firstWrapper);
               //debugShowPoly(secondWrapper);
 
-              carve::poly::Polyhedron* cube = genBox(Rect3d(sphereCenter - Vector3d(radius, radius, radius), 2 * Vector3d(radius, radius, radius)));
+              Rect3d cubeRect(sphereCenter - Vector3d(radius, radius, radius), 2 * Vector3d(radius, radius, radius));
 
               carve::csg::CSG_TreeNode* node0 = new carve::csg::CSG_OPNode(
                   new carve::csg::CSG_PolyNode(secondWrapper, true),
@@ -347,26 +581,38 @@ namespace qr {
                   carve::csg::CSG::INTERSECTION,
                   true
                 );
-              carve::csg::CSG csg0;
-              carve::poly::Polyhedron* tmpPoly = node0->eval(csg0);
-              tmpPoly->canonicalize();
+              carve::poly::Polyhedron* tmpPoly;
+              {
+                CarveLock locker;
+                carve::csg::CSG csg0;
+                tmpPoly = node0->eval(csg0);
+                tmpPoly->canonicalize();
+              }
               
               //debugShowPoly(tmpPoly);
 
-              carve::csg::CSG_TreeNode* node1 =  new carve::csg::CSG_OPNode(
-                  new carve::csg::CSG_PolyNode(cube, true),
-                  new carve::csg::CSG_PolyNode(tmpPoly, true),
-                  carve::csg::CSG::INTERSECTION,
-                  true
-                );
-              carve::csg::CSG csg1;
-              carve::poly::Polyhedron* boundingPoly = node1->eval(csg1);
-              boundingPoly->canonicalize();
+              carve::poly::Polyhedron* boundingPoly;
+              if(CsgCuller::contains(cubeRect, CsgCuller::boundingRect(tmpPoly))) {
+                /* Cube is a box, so it doesn't cut anything off. */
+                boundingPoly = tmpPoly;
+                mCuller.skip();
+              } else {
+                carve::csg::CSG_TreeNode* node1 =  new carve::csg::CSG_OPNode(
+                    new carve::csg::CSG_PolyNode(mPrimitives.box(cubeRect), true),
+                    new carve::csg::CSG_PolyNode(tmpPoly, true),
+                    carve::csg::CSG::INTERSECTION,
+                    true
+                  );
+                CarveLock locker;
+                carve::csg::CSG csg1;
+                boundingPoly = node1->eval(csg1);
+                boundingPoly->canonicalize();
+              }
 
               //debugShowPoly(boundingPoly);
 
               /* Create result. */
-              carve::poly::Polyhedron* spherePoly = genSphere(sphereCenter, radius);
+              carve::poly::Polyhedron* spherePoly = mPrimitives.sphere(sphereCenter, radius, tessellation);
 
               carve::csg::CSG_TreeNode* anotherNode = 
                 new carve::csg::CSG_OPNode(
@@ -375,9 +621,13 @@ namespace qr {
                   carve::csg::CSG::INTERSECTION,
                   true
                 );
-              carve::csg::CSG csg;
-              carve::poly::Polyhedron* intPoly = anotherNode->eval(csg);
-              intPoly->canonicalize();
+              carve::poly::Polyhedron* intPoly;
+              {
+                CarveLock locker;
+                carve::csg::CSG csg;
+                intPoly = anotherNode->eval(csg);
+                intPoly->canonicalize();
+              }
 
               if(mLoopFormation->type() == LoopFormation::PROTRUSION) {
                 mSubtractions.push_back(boundingPoly);
@@ -395,6 +645,7 @@ namespace qr {
           }
         }
       }
+      qDeleteAll(arcIndices);
 
       /* Put all loops with arcs in tail. */
       for(int i = 0; i < loops.size(); i++) {
@@ -408,33 +659,49 @@ namespace qr {
         }
       }
 
-      for(int i = 0; i < mAttempts; i++) {
-        carve::csg::CSG_TreeNode* node = NULL;
+      /* Try several orderings at once. First comes the one above, then the one
+       * with the smallest prism bounding boxes first, then seeded shuffles.
+       * The successful ordering with the lowest index wins, so runs are
+       * reproducible. Evaluations take turns on CarveLock, and orderings
+       * that come after a successful one are skipped if not started yet. */
+      std::vector<QList<Loop*> > orderings(mAttempts, loops);
+      if(mAttempts > 1) {
+        QHash<Loop*, double> volumes;
         foreach(Loop* loop, loops) {
-          carve::poly::Polyhedron* extrudedLoop = LoopExtruder(loop)();
-          if(node == NULL)
-            node = new carve::csg::CSG_PolyNode(extrudedLoop, true);
-          else
-            node = new carve::csg::CSG_OPNode(new carve::csg::CSG_PolyNode(extrudedLoop, true), node, carve::csg::CSG::INTERSECTION, true);
-          //debugSavePoly(extrudedLoop, carve::csg::CSG::INTERSECTION);
+          Rect3d rect = mCache.boundingRect(loop, depths[loop].min, depths[loop].max);
+          volumes.insert(loop, rect.size(0) * rect.size(1) * rect.size(2));
         }
+        std::stable_sort(orderings[1].begin(), orderings[1].end(), VolumeLess(volumes));
+      }
+      for(int i = 2; i < mAttempts; i++) {
+        ShuffleRandom random(i);
+        std::random_shuffle(orderings[i].begin(), orderings[i].end(), random);
+      }
 
-        try {
-          carve::csg::CSG csg;
-          result = node->eval(csg);
-          break;
-        } catch (carve::exception&) {}
+      std::vector<carve::poly::Polyhedron*> results(mAttempts, NULL);
+      if(isEmpty) {
+        mCuller.skip(loops.size() - 1);
+      } else {
+        QAtomicInt firstSuccess(mAttempts);
+        parallelFor(mAttempts, IntersectionAttempt(orderings, depths, mCache, results, firstSuccess));
+      }
 
-        std::random_shuffle(loops.begin(), loops.end());
+      for(int i = 0; i < mAttempts; i++) {
+        if(result == NULL)
+          result = results[i];
+        else
+          delete results[i];
       }
 
       if(result != NULL) {
+        mCuller.cullSubtractions(CsgCuller::boundingRect(result), subtractions);
         foreach(carve::poly::Polyhedron* subtration, subtractions) {
           carve::csg::CSG_TreeNode* lNode = new carve::csg::CSG_PolyNode(result, true);
           carve::csg::CSG_TreeNode* rNode = new carve::csg::CSG_PolyNode(subtration, true);
           carve::csg::CSG::OP op = carve::csg::CSG::A_MINUS_B;
           carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
 
+          CarveLock locker;
           carve::csg::CSG csg;
           result = node->eval(csg);
           result->canonicalize();
@@ -446,14 +713,20 @@ namespace qr {
           carve::csg::CSG::OP op = carve::csg::CSG::UNION;
           carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
 
+          CarveLock locker;
           carve::csg::CSG csg;
           result = node->eval(csg);
           result->canonicalize();
         }
+      } else {
+        /* Sphere pieces have nothing to be applied to. */
+        qDeleteAll(subtractions);
+        qDeleteAll(additions);
       }
     }
 
     if(result != NULL) {
+      CarveLock locker;
       result->canonicalize();
       //debugShowPoly(result);
     }
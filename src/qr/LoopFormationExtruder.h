@@ -6,6 +6,9 @@
 #include <QList>
 #include <carve/poly.hpp>
 #include "LoopFormation.h"
+#include "LoopExtruder.h"
+#include "CsgCuller.h"
+#include "PrimitiveCache.h"
 
 namespace qr {
 // -------------------------------------------------------------------------- //
@@ -13,8 +16,8 @@ namespace qr {
 // -------------------------------------------------------------------------- //
   class LoopFormationExtruder {
   public:
-    LoopFormationExtruder(LoopFormation* loopFormation, int attempts, QList<carve::poly::Polyhedron*>& subtractions, QList<carve::poly::Polyhedron*>& additions): 
-      mLoopFormation(loopFormation), mAttempts(attempts), mSubtractions(subtractions), mAdditions(additions)
+    LoopFormationExtruder(LoopFormation* loopFormation, int attempts, LoopExtrusionCache& cache, PrimitiveCache& primitives, CsgCuller& culler, QList<carve::poly::Polyhedron*>& subtractions, QList<carve::poly::Polyhedron*>& additions): 
+      mLoopFormation(loopFormation), mAttempts(attempts), mCache(cache), mPrimitives(primitives), mCuller(culler), mSubtractions(subtractions), mAdditions(additions)
     {
       assert(attempts > 0);
     }
@@ -24,6 +27,9 @@ namespace qr {
   private:
     LoopFormation* mLoopFormation;
     int mAttempts;
+    LoopExtrusionCache& mCache;
+    PrimitiveCache& mPrimitives;
+    CsgCuller& mCuller;
     QList<carve::poly::Polyhedron*> &mSubtractions, &mAdditions;
   };
 
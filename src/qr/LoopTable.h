@@ -0,0 +1,255 @@
+#ifndef __QR_LOOP_TABLE_H__
+#define __QR_LOOP_TABLE_H__
+
+#include "config.h"
+#include <cassert>
+#include <vector>
+#include <algorithm> /* for std::sort(), std::unique() */
+#include <boost/noncopyable.hpp>
+#include <boost/array.hpp>
+#include <boost/foreach.hpp>
+#include <Eigen/StdVector>
+#include <QList>
+#include <QHash>
+#include "Edge.h"
+#include "Vertex.h"
+#include "Loop.h"
+
+namespace qr {
+  class LoopTable;
+
+// -------------------------------------------------------------------------- //
+// LoopSpan
+// -------------------------------------------------------------------------- //
+  /**
+   * LoopSpan is a read-only view of a single frozen loop inside a loop table.
+   *
+   * The i-th vertex of a span is the common vertex of its i-th and (i + 1)-th
+   * edges, just like in Loop::vertices(). */
+  class LoopSpan {
+  public:
+    int size() const {
+      return mSize;
+    }
+
+    /** @returns                       Index of the given loop edge in the list of view edges. */
+    int edgeIndex(int index) const;
+
+    Edge* edge(int index) const;
+
+    /** @returns                       Index of the given loop vertex in the list of view vertices. */
+    int vertexIndex(int index) const;
+
+    Vertex* vertex(int index) const;
+
+    LoopVertex::Type vertexType(int index) const;
+
+    int normalVertexCount() const {
+      return mNormalSize;
+    }
+
+    const Rect2d& boundingRect() const;
+
+    const Rect3d& boundingRect3d() const;
+
+    /** @returns                       Pointer to the sorted unique 3d coordinates of loop vertices along the given axis. */
+    const double* coordinates(int axis) const;
+
+    int coordinateCount(int axis) const {
+      return mCoordinateCounts[axis];
+    }
+
+    /** @returns                       Pointer to the sorted unique 3d coordinates of NORMAL loop vertices along the given axis. */
+    const double* normalCoordinates(int axis) const;
+
+    int normalCoordinateCount(int axis) const {
+      return mNormalCoordinateCounts[axis];
+    }
+
+  private:
+    friend class LoopTable;
+
+    const LoopTable* mTable;
+    int mIndex;
+    int mOffset;
+    int mSize;
+    int mNormalSize;
+    int mCoordinateOffsets[3];
+    int mCoordinateCounts[3];
+    int mNormalCoordinateCounts[3];
+  };
+
+
+// -------------------------------------------------------------------------- //
+// LoopTable
+// -------------------------------------------------------------------------- //
+  /**
+   * LoopTable stores frozen loops of a single view in flat arrays.
+   *
+   * All loops share the same edge index, vertex index, vertex type and
+   * coordinate arrays, and each loop is given a span into them. Coordinates
+   * of each loop are stored twice per axis, first for NORMAL vertices only,
+   * then for all vertices, both sorted and with duplicates removed. */
+  class LoopTable: private boost::noncopyable {
+  public:
+    LoopTable(): mEdges(NULL), mVertices(NULL) {}
+
+    /**
+     * Freezes the given loops and rebuilds the table from them.
+     *
+     * @param loops                    Loops of the view.
+     * @param edges                    Edges of the view. Must outlive the table.
+     * @param vertices                 Vertices of the view. Must outlive the table. */
+    void build(const QList<Loop*>& loops, const QList<Edge*>& edges, const QList<Vertex*>& vertices) {
+      clear();
+      mEdges = &edges;
+      mVertices = &vertices;
+
+      QHash<Edge*, int> edgeIndices;
+      for(int i = 0; i < edges.size(); i++)
+        edgeIndices.insert(edges[i], i);
+
+      QHash<Vertex*, int> vertexIndices;
+      for(int i = 0; i < vertices.size(); i++)
+        vertexIndices.insert(vertices[i], i);
+
+      mSpans.reserve(loops.size());
+      foreach(Loop* loop, loops) {
+        loop->freeze();
+
+        LoopSpan span;
+        span.mTable = this;
+        span.mIndex = static_cast<int>(mSpans.size());
+        span.mOffset = static_cast<int>(mEdgeIndices.size());
+        span.mSize = loop->edges().size();
+        span.mNormalSize = 0;
+
+        foreach(Edge* edge, loop->edges()) {
+          assert(edgeIndices.contains(edge));
+          mEdgeIndices.push_back(edgeIndices[edge]);
+        }
+
+        foreach(const LoopVertex& loopVertex, loop->vertices()) {
+          assert(vertexIndices.contains(loopVertex.vertex()));
+          mVertexIndices.push_back(vertexIndices[loopVertex.vertex()]);
+          mVertexTypes.push_back(static_cast<unsigned char>(loopVertex.type()));
+          if(loopVertex.type() == LoopVertex::NORMAL)
+            span.mNormalSize++;
+        }
+
+        for(int axis = 0; axis < 3; axis++) {
+          std::vector<double>& coordinates = mCoordinates[axis];
+          span.mCoordinateOffsets[axis] = static_cast<int>(coordinates.size());
+
+          foreach(const LoopVertex& loopVertex, loop->vertices())
+            if(loopVertex.type() == LoopVertex::NORMAL)
+              coordinates.push_back(loopVertex.vertex()->pos3d(axis));
+          span.mNormalCoordinateCounts[axis] = sortUnique(coordinates, span.mCoordinateOffsets[axis]);
+
+          int offset = static_cast<int>(coordinates.size());
+          foreach(const LoopVertex& loopVertex, loop->vertices())
+            coordinates.push_back(loopVertex.vertex()->pos3d(axis));
+          span.mCoordinateCounts[axis] = sortUnique(coordinates, offset);
+        }
+
+        mBoundingRects.push_back(loop->boundingRect());
+        mBoundingRects3d.push_back(loop->boundingRect3d());
+        mSpans.push_back(span);
+      }
+
+      /* Spans won't move anymore, so loops can point to them now. */
+      for(int i = 0; i < loops.size(); i++)
+        loops[i]->setSpan(&mSpans[i]);
+    }
+
+    void clear() {
+      mSpans.clear();
+      mEdgeIndices.clear();
+      mVertexIndices.clear();
+      mVertexTypes.clear();
+      mBoundingRects.clear();
+      mBoundingRects3d.clear();
+      for(int axis = 0; axis < 3; axis++)
+        mCoordinates[axis].clear();
+      mEdges = NULL;
+      mVertices = NULL;
+    }
+
+    int size() const {
+      return static_cast<int>(mSpans.size());
+    }
+
+    const LoopSpan& span(int index) const {
+      return mSpans[index];
+    }
+
+  private:
+    friend class LoopSpan;
+
+    /** Sorts the tail of the given vector starting at offset and removes duplicates from it. @returns Size of the tail. */
+    static int sortUnique(std::vector<double>& coordinates, int offset) {
+      std::sort(coordinates.begin() + offset, coordinates.end());
+      coordinates.erase(std::unique(coordinates.begin() + offset, coordinates.end()), coordinates.end());
+      return static_cast<int>(coordinates.size()) - offset;
+    }
+
+    std::vector<LoopSpan> mSpans;
+    std::vector<int> mEdgeIndices;
+    std::vector<int> mVertexIndices;
+    std::vector<unsigned char> mVertexTypes;
+    std::vector<Rect2d, Eigen::aligned_allocator<Rect2d> > mBoundingRects;
+    std::vector<Rect3d> mBoundingRects3d;
+    boost::array<std::vector<double>, 3> mCoordinates;
+    const QList<Edge*>* mEdges;
+    const QList<Vertex*>* mVertices;
+  };
+
+
+// -------------------------------------------------------------------------- //
+// LoopSpan implementation
+// -------------------------------------------------------------------------- //
+  inline int LoopSpan::edgeIndex(int index) const {
+    assert(index >= 0 && index < mSize);
+
+    return mTable->mEdgeIndices[mOffset + index];
+  }
+
+  inline Edge* LoopSpan::edge(int index) const {
+    return (*mTable->mEdges)[edgeIndex(index)];
+  }
+
+  inline int LoopSpan::vertexIndex(int index) const {
+    assert(index >= 0 && index < mSize);
+
+    return mTable->mVertexIndices[mOffset + index];
+  }
+
+  inline Vertex* LoopSpan::vertex(int index) const {
+    return (*mTable->mVertices)[vertexIndex(index)];
+  }
+
+  inline LoopVertex::Type LoopSpan::vertexType(int index) const {
+    assert(index >= 0 && index < mSize);
+
+    return static_cast<LoopVertex::Type>(mTable->mVertexTypes[mOffset + index]);
+  }
+
+  inline const Rect2d& LoopSpan::boundingRect() const {
+    return mTable->mBoundingRects[mIndex];
+  }
+
+  inline const Rect3d& LoopSpan::boundingRect3d() const {
+    return mTable->mBoundingRects3d[mIndex];
+  }
+
+  inline const double* LoopSpan::coordinates(int axis) const {
+    return &mTable->mCoordinates[axis][0] + mCoordinateOffsets[axis] + mNormalCoordinateCounts[axis];
+  }
+
+  inline const double* LoopSpan::normalCoordinates(int axis) const {
+    return &mTable->mCoordinates[axis][0] + mCoordinateOffsets[axis];
+  }
+
+} // namespace qr
+
+#endif // __QR_LOOP_TABLE_H__
@@ -41,6 +41,22 @@ namespace qr {
       return isTrapezoid(loop->edge(0), loop->edge(1), loop->edge(2), loop->edge(3), prec) || isTrapezoid(loop->edge(1), loop->edge(2), loop->edge(3), loop->edge(0), prec);
     }
 
+    /** @returns                       True if the given loop is an axis-aligned rectangle, its edges may be phantom. */
+    static bool isRectangle(Loop* loop, double prec) {
+      if(loop->edges().size() != 4)
+        return false;
+
+      foreach(Edge* edge, loop->edges()) {
+        if(edge->type() != Edge::LINE)
+          return false;
+
+        Vector2d direction = edge->end(1) - edge->end(0);
+        if(std::abs(direction.x()) > prec && std::abs(direction.y()) > prec)
+          return false;
+      }
+      return true;
+    }
+
   private: 
     static bool isTrapezoid(Edge* /*l*/, Edge* u, Edge* /*r*/, Edge* d, double prec) {
       return u->asSegment().isParallel(d->asSegment(), prec);
@@ -105,12 +105,13 @@ namespace qr {
     (void) Preprocessor(mDrawing, 1.0e-6)();
     QList<View*> views = ViewConstructor(mDrawing, 1.0e-6)();
     (void) VertexClassifier(views)();
-    (void) LoopConstructor(views, 1.0e-6)();
+    (void) LoopConstructor(views)();
     (void) RelationConstructor(views, 1.0e-6)();
     (void) RelationFilter(views)();
     ViewBox* viewBox = PlaneFolder(views)();
     (void) LoopFormationConstructor(viewBox, 1.0e-6)();
-    carve::poly::Polyhedron* poly = ObjectConstructor(viewBox, 8)();
+    ObjectConstructor objectConstructor(viewBox, 8);
+    carve::poly::Polyhedron* poly = objectConstructor();
 
     mGraphicsScene->clear();
     QString plainText;
@@ -131,6 +132,7 @@ namespace qr {
         );
       }
     }
+    plainText.append("Skipped boolean operations: " + QString::number(objectConstructor.skippedOperations()) + "\n");
 
     mViewBoxGlItem = new ViewBoxGlItem(viewBox);
     mPolyhedronGlItem = new PolyhedronGlItem(poly);
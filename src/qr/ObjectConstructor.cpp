@@ -1,13 +1,119 @@
 #include "ObjectConstructor.h"
-#include <algorithm> /* for std::swap() */
+#include <algorithm> /* for std::swap(), std::stable_sort() */
 #include <iterator> /* for std::back_inserter() */
+#include <vector>
 #include <QHash>
 #include <carve/csg.hpp>
 #include <carve/tree.hpp>
 #include "LoopFormationExtruder.h"
+#include "Parallel.h"
+#include "CarveLock.h"
 #include "Debug.h"
 
 namespace qr {
+  namespace {
+    /** @returns                       Result of the given CSG operation, operands are consumed. */
+    carve::poly::Polyhedron* evaluate(carve::poly::Polyhedron* a, carve::poly::Polyhedron* b, carve::csg::CSG::OP op) {
+      carve::csg::CSG_TreeNode* lNode = new carve::csg::CSG_PolyNode(a, true);
+      carve::csg::CSG_TreeNode* rNode = new carve::csg::CSG_PolyNode(b, true);
+      carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
+
+      carve::poly::Polyhedron* result;
+      {
+        CarveLock locker;
+        carve::csg::CSG csg;
+        result = node->eval(csg);
+        result->canonicalize();
+      }
+      delete node;
+      return result;
+    }
+
+    class FaceCountLess {
+    public:
+      bool operator() (carve::poly::Polyhedron* a, carve::poly::Polyhedron* b) const {
+        return a->faces.size() < b->faces.size();
+      }
+    };
+
+    /** Unites pairs of adjacent polyhedrons, so that different pairs can be united concurrently. */
+    class PairUnion {
+    public:
+      PairUnion(const std::vector<carve::poly::Polyhedron*>& polys, std::vector<carve::poly::Polyhedron*>& results): mPolys(polys), mResults(results) {}
+
+      void operator() (int index) const {
+        mResults[index] = evaluate(mPolys[2 * index], mPolys[2 * index + 1], carve::csg::CSG::UNION);
+      }
+
+    private:
+      const std::vector<carve::poly::Polyhedron*>& mPolys;
+      std::vector<carve::poly::Polyhedron*>& mResults;
+    };
+
+    /**
+     * Unites the given polyhedrons with a balanced tree of unions.
+     *
+     * Cost of a union grows with the face counts of its operands, so on each
+     * level polyhedrons are sorted by face count and the cheapest ones are
+     * paired first, Huffman style. Unions of one level are independent, but
+     * carve evaluates them one at a time, see CarveLock. Polyhedrons are
+     * consumed, NULL ones are skipped.
+     *
+     * @returns                        Union of the given polyhedrons, or NULL if there are none. */
+    carve::poly::Polyhedron* unite(const QList<carve::poly::Polyhedron*>& polys) {
+      std::vector<carve::poly::Polyhedron*> level;
+      foreach(carve::poly::Polyhedron* poly, polys)
+        if(poly != NULL)
+          level.push_back(poly);
+      if(level.empty())
+        return NULL;
+
+      while(level.size() > 1) {
+        std::stable_sort(level.begin(), level.end(), FaceCountLess());
+
+        int pairCount = static_cast<int>(level.size()) / 2;
+        std::vector<carve::poly::Polyhedron*> nextLevel(pairCount);
+        parallelFor(pairCount, PairUnion(level, nextLevel));
+        if(level.size() % 2 == 1)
+          nextLevel.push_back(level.back());
+        level.swap(nextLevel);
+      }
+      return level[0];
+    }
+
+    /** Results of extrusion of a single loop formation. */
+    struct Extrusion {
+      Extrusion(): poly(NULL) {}
+
+      carve::poly::Polyhedron* poly;
+      QList<carve::poly::Polyhedron*> subtractions;
+      QList<carve::poly::Polyhedron*> additions;
+    };
+
+    /**
+     * Extrudes loop formations, each into its own output lists, so that
+     * different formations can be extruded concurrently. */
+    class FormationExtruder {
+    public:
+      FormationExtruder(const QList<LoopFormation*>& loopFormations, int attempts, LoopExtrusionCache& cache, PrimitiveCache& primitives, CsgCuller& culler, std::vector<Extrusion>& extrusions):
+        mLoopFormations(loopFormations), mAttempts(attempts), mCache(cache), mPrimitives(primitives), mCuller(culler), mExtrusions(extrusions) {}
+
+      void operator() (int index) const {
+        Extrusion& extrusion = mExtrusions[index];
+        extrusion.poly = LoopFormationExtruder(mLoopFormations[index], mAttempts, mCache, mPrimitives, mCuller, extrusion.subtractions, extrusion.additions)();
+      }
+
+    private:
+      const QList<LoopFormation*>& mLoopFormations;
+      int mAttempts;
+      LoopExtrusionCache& mCache;
+      PrimitiveCache& mPrimitives;
+      CsgCuller& mCuller;
+      std::vector<Extrusion>& mExtrusions;
+    };
+
+  } // namespace
+
 // -------------------------------------------------------------------------- //
 // ObjectConstructor
 // -------------------------------------------------------------------------- //
@@ -19,9 +125,31 @@ namespace qr {
     QList<carve::poly::Polyhedron*> subtractions;
     QList<carve::poly::Polyhedron*> additions;
 
+    /* Bounding rect of the view box is computed lazily, make sure it's there
+     * before the extruders start reading it concurrently. */
+    mViewBox->boundingRect();
+
+    /* Extrude in parallel, then merge the outputs in formation order. Loops
+     * shared between formations are extruded only once, and primitives of
+     * the same tessellation share their topology.
+     *
+     * The caches live for this call only. They and the culler are shared by
+     * all the extruders, so each of them guards itself with a mutex. Cached
+     * polyhedrons are never modified, extruders get copies of them.
+     *
+     * All calls into carve go through CarveLock, so what actually runs in
+     * parallel is loop extrusion, tessellation and sphere detection. */
+    LoopExtrusionCache cache;
+    PrimitiveCache primitives;
+    std::vector<Extrusion> extrusions(loopFormations.size());
+    parallelFor(loopFormations.size(), FormationExtruder(loopFormations, mAttempts, cache, primitives, mCuller, extrusions));
+
     QHash<LoopFormation*, carve::poly::Polyhedron*> formationPolygons;
-    foreach(LoopFormation* loopFormation, loopFormations)
-      formationPolygons[loopFormation] = LoopFormationExtruder(loopFormation, mAttempts, subtractions, additions)();
+    for(int i = 0; i < loopFormations.size(); i++) {
+      formationPolygons[loopFormations[i]] = extrusions[i].poly;
+      subtractions.append(extrusions[i].subtractions);
+      additions.append(extrusions[i].additions);
+    }
 
     /* Protrusions go first. */
     for(int i = 0; i < loopFormations.size(); i++)
@@ -29,8 +157,10 @@ namespace qr {
         if(loopFormations[i]->type() == LoopFormation::DEPRESSION && loopFormations[j]->type() == LoopFormation::PROTRUSION)
           std::swap(loopFormations[i], loopFormations[j]);
 
-    carve::poly::Polyhedron* result = NULL;
-
+    /* Split formation solids, protrusions are merged into the solid and everything else is cut out of it.
+     * If there are no protrusions then the first depression is the one to cut from. Since
+     * (A - B) - C = A - (B u C), all the cuts can be done at once. */
+    QList<carve::poly::Polyhedron*> protrusions, depressions;
     foreach(LoopFormation* loopFormation, loopFormations) {
       carve::poly::Polyhedron* poly = formationPolygons[loopFormation];
 
@@ -38,42 +168,30 @@ namespace qr {
 
       if(poly == NULL)
         continue;
-      if(result == NULL) {
-        result = poly;
-      } else {
-        carve::csg::CSG_TreeNode* lNode = new carve::csg::CSG_PolyNode(result, true);
-        carve::csg::CSG_TreeNode* rNode = new carve::csg::CSG_PolyNode(poly, true);
-        carve::csg::CSG::OP op = loopFormation->type() == LoopFormation::PROTRUSION ? carve::csg::CSG::UNION : carve::csg::CSG::A_MINUS_B;
-        carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
-
-        carve::csg::CSG csg;
-        result = node->eval(csg);
-        result->canonicalize();
-      }
+      if(loopFormation->type() == LoopFormation::PROTRUSION)
+        protrusions.push_back(poly);
+      else
+        depressions.push_back(poly);
     }
+    if(protrusions.empty() && !depressions.empty())
+      protrusions.push_back(depressions.takeFirst());
 
-    //debugShowPoly(result);
-
-    foreach(carve::poly::Polyhedron* subtraction, subtractions) {
-      carve::csg::CSG_TreeNode* lNode = new carve::csg::CSG_PolyNode(result, true);
-      carve::csg::CSG_TreeNode* rNode = new carve::csg::CSG_PolyNode(subtraction, true);
-      carve::csg::CSG::OP op = carve::csg::CSG::A_MINUS_B;
-      carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
+    carve::poly::Polyhedron* result = unite(protrusions);
+    if(result != NULL)
+      mCuller.cullSubtractions(CsgCuller::boundingRect(result), depressions);
+    if(result != NULL && !depressions.empty())
+      result = evaluate(result, unite(depressions), carve::csg::CSG::A_MINUS_B);
 
-      carve::csg::CSG csg;
-      result = node->eval(csg);
-      result->canonicalize();
-    }
+    //debugShowPoly(result);
 
-    foreach(carve::poly::Polyhedron* addition, additions) {
-      carve::csg::CSG_TreeNode* lNode = new carve::csg::CSG_PolyNode(result, true);
-      carve::csg::CSG_TreeNode* rNode = new carve::csg::CSG_PolyNode(addition, true);
-      carve::csg::CSG::OP op = carve::csg::CSG::UNION;
-      carve::csg::CSG_TreeNode* node = new carve::csg::CSG_OPNode(lNode, rNode, op, true);
+    if(result != NULL)
+      mCuller.cullSubtractions(CsgCuller::boundingRect(result), subtractions);
+    if(result != NULL && !subtractions.empty())
+      result = evaluate(result, unite(subtractions), carve::csg::CSG::A_MINUS_B);
 
-      carve::csg::CSG csg;
-      result = node->eval(csg);
-      result->canonicalize();
+    if(!additions.empty()) {
+      additions.push_front(result);
+      result = unite(additions);
     }
 
     return result;
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <carve/poly.hpp>
 #include "ViewBox.h"
+#include "CsgCuller.h"
 
 namespace qr {
 // -------------------------------------------------------------------------- //
@@ -18,9 +19,15 @@ namespace qr {
 
     carve::poly::Polyhedron* operator() ();
 
+    /** @returns                       Number of boolean operations that were resolved without evaluation. */
+    int skippedOperations() const {
+      return mCuller.skipped();
+    }
+
   private:
     ViewBox* mViewBox;
     int mAttempts;
+    CsgCuller mCuller;
   };
 
 } // namespace qr
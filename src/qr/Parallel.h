@@ -0,0 +1,79 @@
+#ifndef __QR_PARALLEL_H__
+#define __QR_PARALLEL_H__
+
+#include "config.h"
+#include <QList>
+#include <QVector>
+#include <QtConcurrentMap>
+
+namespace qr {
+  namespace detail {
+    template<class Functor>
+    class IndexedCall {
+    public:
+      typedef void result_type;
+
+      IndexedCall(const Functor& functor): mFunctor(functor) {}
+
+      void operator() (int& index) const {
+        mFunctor(index);
+      }
+
+    private:
+      Functor mFunctor;
+    };
+
+    template<class Object, class Item>
+    class MethodCall {
+    public:
+      MethodCall(const Object* object, void (Object::*method)(Item) const, const QList<Item>& items): mObject(object), mMethod(method), mItems(items) {}
+
+      void operator() (int index) const {
+        (mObject->*mMethod)(mItems[index]);
+      }
+
+    private:
+      const Object* mObject;
+      void (Object::*mMethod)(Item) const;
+      const QList<Item>& mItems;
+    };
+
+  } // namespace detail
+
+
+// -------------------------------------------------------------------------- //
+// parallelFor
+// -------------------------------------------------------------------------- //
+  /**
+   * Calls functor(i) for every i in [0, count) on the global thread pool and
+   * waits for all calls to finish.
+   *
+   * Calls are executed concurrently and in no particular order, so the functor
+   * must only write to state owned by its index. */
+  template<class Functor>
+  void parallelFor(int count, const Functor& functor) {
+    QVector<int> indices(count);
+    for(int i = 0; i < count; i++)
+      indices[i] = i;
+
+    QtConcurrent::blockingMap(indices, detail::IndexedCall<Functor>(functor));
+  }
+
+
+// -------------------------------------------------------------------------- //
+// parallelForEach
+// -------------------------------------------------------------------------- //
+  /**
+   * Calls (object->*method)(item) for every item of the given list on the 
+   * global thread pool and waits for all calls to finish.
+   *
+   * Same restrictions as for parallelFor() apply, i.e. the method must only 
+   * modify state owned by its item. */
+  template<class Object, class Item>
+  void parallelForEach(const QList<Item>& items, const Object* object, void (Object::*method)(Item) const) {
+    parallelFor(items.size(), detail::MethodCall<Object, Item>(object, method, items));
+  }
+
+} // namespace qr
+
+#endif // __QR_PARALLEL_H__
@@ -0,0 +1,176 @@
+#ifndef __QR_PREDICATES_H__
+#define __QR_PREDICATES_H__
+
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include "Algebra.h"
+
+namespace qr {
+  namespace detail {
+    /* Error-free transformations & expansion arithmetic, see
+     * J. R. Shewchuk, "Adaptive Precision Floating-Point Arithmetic and Fast
+     * Robust Geometric Predicates". Assumes round-to-nearest double arithmetic
+     * without extended intermediate precision. */
+
+    inline void twoSum(double a, double b, double& x, double& y) {
+      x = a + b;
+      double bVirtual = x - a;
+      double aVirtual = x - bVirtual;
+      y = (a - aVirtual) + (b - bVirtual);
+    }
+
+    inline void twoDiff(double a, double b, double& x, double& y) {
+      x = a - b;
+      double bVirtual = a - x;
+      double aVirtual = x + bVirtual;
+      y = (a - aVirtual) + (bVirtual - b);
+    }
+
+    inline void split(double a, double& hi, double& lo) {
+      double c = 134217729.0 * a; /* 2^27 + 1. */
+      double aBig = c - a;
+      hi = c - aBig;
+      lo = a - hi;
+    }
+
+    inline void twoProduct(double a, double b, double& x, double& y) {
+      x = a * b;
+      double aHi, aLo, bHi, bLo;
+      split(a, aHi, aLo);
+      split(b, bHi, bLo);
+      double err1 = x - aHi * bHi;
+      double err2 = err1 - aLo * bHi;
+      double err3 = err2 - aHi * bLo;
+      y = aLo * bLo - err3;
+    }
+
+    /** Adds b to the nonoverlapping expansion e of the given size, in place. @returns New size. */
+    inline int growExpansion(double* e, int size, double b) {
+      double q = b;
+      for(int i = 0; i < size; i++)
+        twoSum(q, e[i], q, e[i]);
+      e[size] = q;
+      return size + 1;
+    }
+
+    /** @returns                       Sign of the expansion. */
+    inline int expansionSign(const double* e, int size) {
+      for(int i = size - 1; i >= 0; i--)
+        if(e[i] != 0.0)
+          return e[i] > 0.0 ? 1 : -1;
+      return 0;
+    }
+
+    /** @returns                       Exact sign of (b - a) x (c - a). */
+    inline int orientationExact(const Vector2d& a, const Vector2d& b, const Vector2d& c) {
+      double l[2][2], r[2][2]; /* Each difference is an exact two-term expansion. */
+      twoDiff(b.x(), a.x(), l[0][0], l[0][1]);
+      twoDiff(c.y(), a.y(), l[1][0], l[1][1]);
+      twoDiff(b.y(), a.y(), r[0][0], r[0][1]);
+      twoDiff(c.x(), a.x(), r[1][0], r[1][1]);
+
+      double e[16];
+      int size = 0;
+      for(int i = 0; i < 2; i++) {
+        for(int j = 0; j < 2; j++) {
+          double x, y;
+          twoProduct(l[0][i], l[1][j], x, y);
+          size = growExpansion(e, size, y);
+          size = growExpansion(e, size, x);
+          twoProduct(r[0][i], r[1][j], x, y);
+          size = growExpansion(e, size, -y);
+          size = growExpansion(e, size, -x);
+        }
+      }
+      return expansionSign(e, size);
+    }
+
+  } // namespace detail
+
+
+// -------------------------------------------------------------------------- //
+// Orientation predicates
+// -------------------------------------------------------------------------- //
+  /**
+   * Orientation test.
+   *
+   * The result is computed in floating point first and is recomputed exactly
+   * only when the floating point error bound does not guarantee its sign.
+   *
+   * @returns                          1 if a, b, c make a counterclockwise turn, -1 if clockwise, 0 if they are collinear. */
+  inline int orientation(const Vector2d& a, const Vector2d& b, const Vector2d& c) {
+    double left = (b.x() - a.x()) * (c.y() - a.y());
+    double right = (b.y() - a.y()) * (c.x() - a.x());
+    double det = left - right;
+
+    /* Bound from Shewchuk's orient2d, (3 + 16 * eps) * eps. */
+    double errorBound = 3.3306690738754716e-16 * (std::abs(left) + std::abs(right));
+    if(det > errorBound)
+      return 1;
+    if(-det > errorBound)
+      return -1;
+    return detail::orientationExact(a, b, c);
+  }
+
+  /** @returns                         Sign of the cross product of the given vectors. */
+  inline int orientation(const Vector2d& u, const Vector2d& v) {
+    return orientation(Vector2d::Zero(), u, v);
+  }
+
+
+// -------------------------------------------------------------------------- //
+// Direction ordering
+// -------------------------------------------------------------------------- //
+  /**
+   * Pseudo-angle of a direction, a trig-free monotone substitute for its angle.
+   *
+   * Grows counterclockwise from 0 for the positive x direction to 4 just below
+   * it, and pseudoAngle(-v) always differs from pseudoAngle(v) by exactly 2. */
+  inline double pseudoAngle(const Vector2d& v) {
+    assert(v.x() != 0.0 || v.y() != 0.0);
+
+    double p = v.y() / (std::abs(v.x()) + std::abs(v.y()));
+    if(v.x() < 0)
+      return 2.0 - p;
+    else if(v.y() < 0)
+      return 4.0 + p;
+    else
+      return p;
+  }
+
+  /** Upper bound on the absolute error of pseudoAngle(). */
+  const double PSEUDO_ANGLE_ERROR = 1.0e-14;
+
+  /** @returns                         0 for directions with angle in [0, pi), 1 for [pi, 2 * pi). */
+  inline int directionHalf(const Vector2d& v) {
+    return (v.y() < 0 || (v.y() == 0 && v.x() < 0)) ? 1 : 0;
+  }
+
+  /** @returns                         Exact result of comparison of angles of the given directions, both taken in [0, 2 * pi). */
+  inline bool isDirectionLess(const Vector2d& u, const Vector2d& v) {
+    int uHalf = directionHalf(u), vHalf = directionHalf(v);
+    if(uHalf != vHalf)
+      return uHalf < vHalf;
+    return orientation(u, v) > 0;
+  }
+
+  /**
+   * Same as isDirectionLess(), but takes precomputed pseudo-angles of the
+   * directions and falls back to the exact test only when they are too close. */
+  inline bool isDirectionLess(const Vector2d& u, double uPseudoAngle, const Vector2d& v, double vPseudoAngle) {
+    if(uPseudoAngle < vPseudoAngle - PSEUDO_ANGLE_ERROR)
+      return true;
+    if(vPseudoAngle < uPseudoAngle - PSEUDO_ANGLE_ERROR)
+      return false;
+    return isDirectionLess(u, v);
+  }
+
+  /** @returns                         True if the sine of the angle between the given vectors does not exceed prec. */
+  inline bool isParallel(const Vector2d& u, const Vector2d& v, double prec) {
+    return std::abs(u.x() * v.y() - u.y() * v.x()) <= prec * u.norm() * v.norm();
+  }
+
+} // namespace qr
+
+#endif // __QR_PREDICATES_H__
@@ -0,0 +1,303 @@
+#ifndef __QR_PRIMITIVE_CACHE_H__
+#define __QR_PRIMITIVE_CACHE_H__
+
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm> /* for std::reverse(), std::max() */
+#include <boost/noncopyable.hpp>
+#include <QHash>
+#include <QPair>
+#include <QMutex>
+#include <QMutexLocker>
+#include <carve/poly.hpp>
+#include <carve/input.hpp>
+#include "GRect.h"
+#include "CarveLock.h"
+#include "Tessellation.h"
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// PrimitiveCache
+// -------------------------------------------------------------------------- //
+  /**
+   * Cache of unit primitives, keyed by the kind and the segment count.
+   *
+   * Each primitive is built and canonicalized once per segment count as a
+   * unit primitive. Requested primitives are copies of unit ones with their
+   * vertices mapped into place, so face topology is never rebuilt. Vertices
+   * are computed with the same expressions as for a primitive built from
+   * scratch, so the results are the same up to vertex order. */
+  class PrimitiveCache: private boost::noncopyable {
+  public:
+    typedef std::vector<Vector3d> Polygon;
+
+    ~PrimitiveCache() {
+      qDeleteAll(mPrototypes);
+    }
+
+    /** @returns                       New sphere, owned by the caller. */
+    carve::poly::Polyhedron* sphere(const Vector3d& center, double radius, const Tessellation& tessellation) {
+      return instance(prototype(SPHERE, tessellation.segmentCount(radius)), SphereMapping(center, radius));
+    }
+
+    /** @returns                       New truncated elliptic cone with the given base and top ellipses, owned by the caller. */
+    carve::poly::Polyhedron* cone(const Vector3d& base, const Vector3d& height, const Vector3d& baseX, const Vector3d& baseY, const Vector3d& topX, const Vector3d& topY, const Tessellation& tessellation) {
+      if(baseX.cross(baseY).dot(height) < 0)
+        return cone(base + height, -height, topX, topY, baseX, baseY, tessellation);
+
+      int slices = tessellation.segmentCount(std::max(std::max(baseX.norm(), baseY.norm()), std::max(topX.norm(), topY.norm())));
+      return instance(prototype(CYLINDER, slices), ConeMapping(base, height, baseX, baseY, topX, topY));
+    }
+
+    /** @returns                       New box, owned by the caller. */
+    carve::poly::Polyhedron* box(const Rect3d& rect) {
+      return instance(prototype(BOX, 0), BoxMapping(rect));
+    }
+
+    /** @returns                       New prism with the given planar polygon as a base, polygon is given relative to the origin. */
+    carve::poly::Polyhedron* prism(const Vector3d& origin, const Vector3d& height, Polygon polygon) {
+      int n = static_cast<int>(polygon.size());
+      assert(n >= 3);
+
+      /* Make the base counterclockwise when looking against the height. */
+      Vector3d normal = Vector3d::Zero();
+      for(int i = 0; i < n; i++)
+        normal += polygon[i].cross(polygon[(i + 1) % n]);
+      if(normal.dot(height) < 0)
+        std::reverse(polygon.begin(), polygon.end());
+
+      return instance(prototype(PRISM, n), PrismMapping(origin, height, polygon));
+    }
+
+  private:
+    enum Kind {
+      SPHERE,
+      CYLINDER,
+      BOX,
+      PRISM
+    };
+
+    typedef QPair<int, int> Key;
+
+    static carve::geom::vector<3> toVECTOR(const Vector3d& v) {
+      return carve::geom::VECTOR(v.x(), v.y(), v.z());
+    }
+
+    /* Mappings from unit primitives. Unit vertices carry the parameters of
+     * the vertex, e.g. the angle and the side of a cone. */
+
+    class SphereMapping {
+    public:
+      SphereMapping(const Vector3d& center, double radius): mCenter(center), mRadius(radius) {}
+
+      carve::geom::vector<3> operator() (const carve::geom::vector<3>& v) const {
+        return toVECTOR(mCenter + mRadius * Vector3d(v.x, v.y, v.z));
+      }
+
+    private:
+      Vector3d mCenter;
+      double mRadius;
+    };
+
+    class ConeMapping {
+    public:
+      ConeMapping(const Vector3d& base, const Vector3d& height, const Vector3d& baseX, const Vector3d& baseY, const Vector3d& topX, const Vector3d& topY):
+        mBase(base), mHeight(height), mBaseX(baseX), mBaseY(baseY), mTopX(topX), mTopY(topY) {}
+
+      carve::geom::vector<3> operator() (const carve::geom::vector<3>& v) const {
+        if(v.z == 0.0)
+          return toVECTOR(mBase +           mBaseX * v.x + mBaseY * v.y);
+        else
+          return toVECTOR(mBase + mHeight + mTopX * v.x + mTopY * v.y);
+      }
+
+    private:
+      Vector3d mBase, mHeight, mBaseX, mBaseY, mTopX, mTopY;
+    };
+
+    class BoxMapping {
+    public:
+      BoxMapping(const Rect3d& rect): mRect(rect) {}
+
+      carve::geom::vector<3> operator() (const carve::geom::vector<3>& v) const {
+        return carve::geom::VECTOR(
+          v.x == 0.0 ? mRect.min(0) : mRect.max(0),
+          v.y == 0.0 ? mRect.min(1) : mRect.max(1),
+          v.z == 0.0 ? mRect.min(2) : mRect.max(2)
+        );
+      }
+
+    private:
+      Rect3d mRect;
+    };
+
+    class PrismMapping {
+    public:
+      PrismMapping(const Vector3d& origin, const Vector3d& height, const Polygon& polygon): mOrigin(origin), mHeight(height), mPolygon(polygon) {}
+
+      carve::geom::vector<3> operator() (const carve::geom::vector<3>& v) const {
+        /* Unit base is a regular polygon, so the angle identifies the vertex. */
+        int n = static_cast<int>(mPolygon.size());
+        int i = static_cast<int>(std::floor(std::atan2(v.y, v.x) * n / (2 * M_PI) + 0.5));
+        i = ((i % n) + n) % n;
+
+        if(v.z == 0.0)
+          return toVECTOR(mOrigin +           mPolygon[i]);
+        else
+          return toVECTOR(mOrigin + mHeight + mPolygon[i]);
+      }
+
+    private:
+      Vector3d mOrigin, mHeight;
+      const Polygon& mPolygon;
+    };
+
+    template<class Mapping>
+    static carve::poly::Polyhedron* instance(const carve::poly::Polyhedron* prototype, const Mapping& mapping) {
+      CarveLock locker;
+      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(*prototype);
+      result->transform(mapping);
+      return result;
+    }
+
+    const carve::poly::Polyhedron* prototype(Kind kind, int count) {
+      Key key(kind, count);
+
+      QMutexLocker locker(&mMutex);
+      carve::poly::Polyhedron* result = mPrototypes.value(key, NULL);
+      if(result == NULL) {
+        switch(kind) {
+        case SPHERE:   result = genUnitSphere(count); break;
+        case CYLINDER: result = genUnitCylinder(count); break;
+        case BOX:      result = genUnitBox(); break;
+        case PRISM:    result = genUnitPrism(count); break;
+        default:
+          assert(false);
+        }
+        mPrototypes.insert(key, result);
+      }
+      return result;
+    }
+
+    static carve::poly::Polyhedron* genPolyhedron(const carve::input::PolyhedronData& data) {
+      CarveLock locker;
+      carve::poly::Polyhedron* result = new carve::poly::Polyhedron(data.points, data.getFaceCount(), data.faceIndices);
+      result->canonicalize();
+      return result;
+    }
+
+    static Vector3d spherePoint(double phi, double psi) {
+      return Vector3d(cos(phi) * cos(psi), sin(phi) * cos(psi), sin(psi));
+    }
+
+    static carve::poly::Polyhedron* genUnitSphere(int slices) {
+      carve::input::PolyhedronData data;
+
+      const int STACKS = slices / 2;
+
+      for(int j = 0; j < STACKS - 1; j++)
+        for(int i = 0; i < slices; i++)
+          data.addVertex(toVECTOR(spherePoint(i * 2 * M_PI / slices, (j + 1) * M_PI / STACKS - M_PI / 2)));
+      data.addVertex(toVECTOR(spherePoint(0, -M_PI / 2)));
+      data.addVertex(toVECTOR(spherePoint(0, M_PI / 2)));
+
+      int n = data.points.size() - 2;
+
+      for(int i = 0; i < slices; i++) {
+        data.addFace(n, (i + 1) % slices, i);
+        data.addFace(n + 1, n - 1 - (i + 1) % slices, n - 1 - i);
+      }
+
+      for(int j = 0; j < STACKS - 2; j++) {
+        for(int i = 0; i < slices; i++) {
+          int i1 = (i + 1) % slices;
+          int j1 = j + 1;
+          data.addFace(j * slices + i, j * slices + i1, j1 * slices + i1, j1 * slices + i);
+        }
+      }
+
+      return genPolyhedron(data);
+    }
+
+    static carve::poly::Polyhedron* genUnitCylinder(int slices) {
+      carve::input::PolyhedronData data;
+
+      for(int i = 0; i < slices; i++) {
+        double a = i * 2 * M_PI / slices;
+        data.addVertex(carve::geom::VECTOR(cos(a), sin(a), 0.0));
+        data.addVertex(carve::geom::VECTOR(cos(a), sin(a), 1.0));
+      }
+
+      /* Add side faces. */
+      for(int i = 0; i < slices; i++)
+        data.addFace(i * 2 + 1, i * 2, (i * 2 + 2) % (slices * 2), (i * 2 + 3) % (slices * 2));
+
+      /* Add basement faces. */
+      std::vector<int> face;
+      face.resize(slices);
+      for(int i = 0; i < slices; i++)
+        face[i] = 2 * (slices - 1) - i * 2;
+      data.addFace(face.begin(), face.end());
+      for(int i = 0; i < slices; i++)
+        face[i] = i * 2 + 1;
+      data.addFace(face.begin(), face.end());
+
+      return genPolyhedron(data);
+    }
+
+    static carve::poly::Polyhedron* genUnitBox() {
+      carve::input::PolyhedronData data;
+
+      data.addVertex(carve::geom::VECTOR(0.0, 0.0, 0.0));
+      data.addVertex(carve::geom::VECTOR(0.0, 0.0, 1.0));
+      data.addVertex(carve::geom::VECTOR(0.0, 1.0, 0.0));
+      data.addVertex(carve::geom::VECTOR(0.0, 1.0, 1.0));
+      data.addVertex(carve::geom::VECTOR(1.0, 0.0, 0.0));
+      data.addVertex(carve::geom::VECTOR(1.0, 0.0, 1.0));
+      data.addVertex(carve::geom::VECTOR(1.0, 1.0, 0.0));
+      data.addVertex(carve::geom::VECTOR(1.0, 1.0, 1.0));
+
+      data.addFace(0, 1, 3, 2);
+      data.addFace(7, 5, 4, 6);
+      data.addFace(0, 2, 6, 4);
+      data.addFace(2, 3, 7, 6);
+      data.addFace(3, 1, 5, 7);
+      data.addFace(1, 0, 4, 5);
+
+      return genPolyhedron(data);
+    }
+
+    static carve::poly::Polyhedron* genUnitPrism(int n) {
+      carve::input::PolyhedronData data;
+
+      for(int i = 0; i < n; i++)
+        data.addVertex(carve::geom::VECTOR(cos(i * 2 * M_PI / n), sin(i * 2 * M_PI / n), 0.0));
+      for(int i = 0; i < n; i++)
+        data.addVertex(carve::geom::VECTOR(cos(i * 2 * M_PI / n), sin(i * 2 * M_PI / n), 1.0));
+
+      /* Add basement faces. */
+      std::vector<int> face;
+      face.resize(n);
+      for(int i = 0; i < n; i++)
+        face[i] = n - 1 - i;
+      data.addFace(face.begin(), face.end());
+      for(int i = 0; i < n; i++)
+        face[i] = n + i;
+      data.addFace(face.begin(), face.end());
+
+      /* Add side faces. */
+      for(int i = 0; i < n; i++)
+        data.addFace(i, (i + 1) % n, n + (i + 1) % n, n + i);
+
+      return genPolyhedron(data);
+    }
+
+    QMutex mMutex;
+    QHash<Key, carve::poly::Polyhedron*> mPrototypes;
+  };
+
+} // namespace qr
+
+#endif // __QR_PRIMITIVE_CACHE_H__
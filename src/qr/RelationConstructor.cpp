@@ -1,53 +1,311 @@
 #include "RelationConstructor.h"
+#include <vector>
+#include <algorithm> /* for std::sort(), std::nth_element() */
+#include <cmath>
 #include <boost/foreach.hpp>
+#include <Eigen/StdVector>
+#include <QHash>
+#include <QVector>
 
 namespace qr {
+  namespace {
+    typedef std::vector<Rect2d, Eigen::aligned_allocator<Rect2d> > RectVector;
+
+    typedef std::vector<Vector2d, Eigen::aligned_allocator<Vector2d> > PointVector;
+
+    qint64 bucket(double value, double step) {
+      return static_cast<qint64>(std::floor(value / step));
+    }
+
+    /**
+     * Index of scalar values.
+     *
+     * Values are bucketed with the precision as a step, so all values within
+     * the precision of a given one lie in its bucket or in the two neighbouring
+     * ones. */
+    class ValueIndex {
+    public:
+      ValueIndex(double prec): mPrec(prec) {}
+
+      void add(double value) {
+        mBuckets.insert(bucket(value, mPrec), mValues.size());
+        mValues.push_back(value);
+      }
+
+      /** @returns                     Indices of all values closer than the precision to the given one, in no particular order. */
+      void find(double value, QVector<int>& result) const {
+        result.clear();
+        qint64 key = bucket(value, mPrec);
+        for(qint64 k = key - 1; k <= key + 1; k++)
+          for(QMultiHash<qint64, int>::const_iterator pos = mBuckets.find(k); pos != mBuckets.end() && pos.key() == k; ++pos)
+            if(std::abs(mValues[*pos] - value) < mPrec)
+              result.push_back(*pos);
+      }
+
+    private:
+      double mPrec;
+      QVector<double> mValues;
+      QMultiHash<qint64, int> mBuckets;
+    };
+
+
+    /**
+     * Bounding volume hierarchy over view rects, for occlusion tests.
+     *
+     * Leaves hold up to LEAF_SIZE rects that are tested in one batch. */
+    class ViewRectTree {
+    public:
+      ViewRectTree(const QList<View*>& views) {
+        for(int i = 0; i < views.size(); i++) {
+          mRects.push_back(views[i]->boundingRect());
+          mIndices.push_back(i);
+        }
+        if(!mRects.empty())
+          build(0, static_cast<int>(mRects.size()));
+      }
+
+      /** @returns                     True if the segment intersects a rect of any view except for the two given ones. */
+      bool intersects(const Segment2d& segment, int skip0, int skip1, double prec) const {
+        if(mNodes.empty())
+          return false;
+        return intersects(0, segment, skip0, skip1, prec);
+      }
+
+    private:
+      enum { LEAF_SIZE = 4 };
+
+      struct Node {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+        Rect2d rect;
+        int lo, hi;
+        int children[2]; /* -1 for leaves. */
+      };
+
+      class CenterLess {
+      public:
+        CenterLess(const RectVector& rects, int axis): mRects(rects), mAxis(axis) {}
+
+        bool operator() (int a, int b) const {
+          return mRects[a].center()[mAxis] < mRects[b].center()[mAxis];
+        }
+
+      private:
+        const RectVector& mRects;
+        int mAxis;
+      };
+
+      int build(int lo, int hi) {
+        Node node;
+        node.lo = lo;
+        node.hi = hi;
+        node.children[0] = node.children[1] = -1;
+        for(int i = lo; i < hi; i++)
+          node.rect.extend(mRects[mIndices[i]]);
+
+        int nodeIndex = static_cast<int>(mNodes.size());
+        mNodes.push_back(node);
+        if(hi - lo <= LEAF_SIZE)
+          return nodeIndex;
+
+        /* Split by the median center along the longest axis. */
+        int axis = node.rect.size(0) > node.rect.size(1) ? 0 : 1;
+        int mid = (lo + hi) / 2;
+        std::nth_element(mIndices.begin() + lo, mIndices.begin() + mid, mIndices.begin() + hi, CenterLess(mRects, axis));
+
+        int left = build(lo, mid);
+        int right = build(mid, hi);
+        mNodes[nodeIndex].children[0] = left;
+        mNodes[nodeIndex].children[1] = right;
+        return nodeIndex;
+      }
+
+      bool intersects(int nodeIndex, const Segment2d& segment, int skip0, int skip1, double prec) const {
+        const Node& node = mNodes[nodeIndex];
+        if(!segment.intersects(node.rect, prec))
+          return false;
+
+        if(node.children[0] == -1) {
+          RectVector rects;
+          for(int i = node.lo; i < node.hi; i++)
+            if(mIndices[i] != skip0 && mIndices[i] != skip1)
+              rects.push_back(mRects[mIndices[i]]);
+          if(rects.empty())
+            return false;
+
+          bool hits[LEAF_SIZE];
+          qr::intersects(segment, &rects[0], static_cast<int>(rects.size()), hits, prec);
+          for(int i = 0; i < static_cast<int>(rects.size()); i++)
+            if(hits[i])
+              return true;
+          return false;
+        }
+
+        return
+          intersects(node.children[0], segment, skip0, skip1, prec) ||
+          intersects(node.children[1], segment, skip0, skip1, prec);
+      }
+
+      RectVector mRects;
+      std::vector<int> mIndices;
+      std::vector<Node, Eigen::aligned_allocator<Node> > mNodes;
+    };
+
+
+    /**
+     * Index of CENTER lines of a single view by their constant coordinate.
+     *
+     * Line::contains() compares the cross product against the largest
+     * coordinate involved, so the distance it tolerates grows with the distance
+     * along the line. For a horizontal or vertical line of length l, any
+     * point it contains lies within prec * max(1, d / l) of it, d being a bound
+     * on the distance from the line origin along the line. Lines for which this
+     * fits into a bucket are indexed, the rest are checked for every query. */
+    class CenterLineIndex {
+    public:
+      CenterLineIndex(const QList<Edge*>& lines, double extent, double prec): mLines(lines), mPrec(prec), mStep(64 * prec) {
+        for(int i = 0; i < lines.size(); i++) {
+          Vector2d direction = lines[i]->end(1) - lines[i]->end(0);
+
+          int axis = -1; /* Axis along which the line coordinate is constant. */
+          if(direction.y() == 0.0)
+            axis = 1;
+          else if(direction.x() == 0.0)
+            axis = 0;
+
+          double length = axis == -1 ? 0.0 : std::abs(direction[1 - axis]);
+          if(length < prec || prec * std::max(1.0, extent / length) > mStep) {
+            mOtherLines.push_back(i);
+          } else {
+            mBuckets[axis].insert(bucket(lines[i]->end(0)[axis], mStep), i);
+          }
+        }
+      }
+
+      /** @returns                     Indices of lines that contain the given point, in order. */
+      void find(const Vector2d& point, QVector<int>& result) const {
+        result = mOtherLines;
+        for(int axis = 0; axis < 2; axis++) {
+          qint64 key = bucket(point[axis], mStep);
+          for(qint64 k = key - 1; k <= key + 1; k++)
+            for(QMultiHash<qint64, int>::const_iterator pos = mBuckets[axis].find(k); pos != mBuckets[axis].end() && pos.key() == k; ++pos)
+              result.push_back(*pos);
+        }
+        std::sort(result.begin(), result.end());
+
+        int size = 0;
+        for(int i = 0; i < result.size(); i++)
+          if(mLines[result[i]]->asSegment().asLine().contains(point, mPrec))
+            result[size++] = result[i];
+        result.resize(size);
+      }
+
+    private:
+      QList<Edge*> mLines;
+      double mPrec, mStep;
+      QVector<int> mOtherLines;
+      QMultiHash<qint64, int> mBuckets[2];
+    };
+
+    enum SizeRelation {
+      PARALLEL_X = 1,
+      PERPENDICULAR_X = 2,
+      PARALLEL_Y = 4,
+      PERPENDICULAR_Y = 8
+    };
+
+  } // namespace
+
 // -------------------------------------------------------------------------- //
 // RelationConstructor
 // -------------------------------------------------------------------------- //
   void RelationConstructor::operator() () {
-    /* Construct parallel / perpendicular size correspondence edges. */
-    foreach(View* aView, mViews) {
-      foreach(View* bView, mViews) {
-        if(aView == bView)
-          continue;
+    int viewCount = mViews.size();
+
+    /* Index view sizes. */
+    ValueIndex widths(mPrec), heights(mPrec);
+    foreach(View* view, mViews) {
+      widths.add(view->boundingRect().size(0));
+      heights.add(view->boundingRect().size(1));
+    }
 
-        /* Determine whether the line segment that connects the centre points 
-         * of a and b traverses the bounding boxes of any other nodes */
-        bool intersects = false;
-        Segment2d segment(aView->center(), bView->center());
-        foreach(View* cView, mViews) {
-          if(cView == aView || cView == bView)
-            continue;
+    ViewRectTree viewTree(mViews);
 
-          if(segment.intersects(cView->boundingRect(), mPrec)) {
-            intersects = true;
-            break;
-          }
+    /* Collect arc centers & index center lines. */
+    std::vector<PointVector> arcCenters(viewCount);
+    Rect2d extentRect;
+    for(int i = 0; i < viewCount; i++) {
+      foreach(Edge* segment, mViews[i]->edges(Edge::NORMAL)) {
+        if(segment->type() == Edge::ARC) {
+          arcCenters[i].push_back(segment->asArc().center());
+          extentRect.extend(segment->asArc().center());
         }
+      }
+      foreach(Edge* segment, mViews[i]->edges(Edge::CENTER))
+        extentRect.extend(segment->end(0));
+    }
+    double extent = extentRect.isEmpty() ? 0.0 : std::max(extentRect.size(0), extentRect.size(1));
 
-        /* TODO: continue if intersects? */
+    QList<CenterLineIndex*> centerLineIndices;
+    foreach(View* view, mViews)
+      centerLineIndices.push_back(new CenterLineIndex(view->edges(Edge::CENTER), extent, mPrec));
+
+    QVector<int> sizeRelations(viewCount);
+    QVector<int> found;
+    for(int a = 0; a < viewCount; a++) {
+      View* aView = mViews[a];
+
+      /* Find views with matching sizes. */
+      Vector2d aSize = aView->boundingRect().size();
+      sizeRelations.fill(0);
+      widths.find(aSize[0], found);
+      foreach(int b, found)
+        sizeRelations[b] |= PARALLEL_X;
+      heights.find(aSize[0], found);
+      foreach(int b, found)
+        sizeRelations[b] |= PERPENDICULAR_X;
+      heights.find(aSize[1], found);
+      foreach(int b, found)
+        sizeRelations[b] |= PARALLEL_Y;
+      widths.find(aSize[1], found);
+      foreach(int b, found)
+        sizeRelations[b] |= PERPENDICULAR_Y;
+
+      /* Index cutting chains by name. */
+      QHash<QString, QList<CuttingChain*> > cuttingChains;
+      foreach(CuttingChain* cuttingChain, aView->cuttingChains())
+        cuttingChains[cuttingChain->name()].push_back(cuttingChain);
+
+      for(int b = 0; b < viewCount; b++) {
+        View* bView = mViews[b];
+        if(aView == bView)
+          continue;
 
         /* Add parallel / perpendicular size correspondence arcs. */
-        if(!intersects) {
-          Vector2d aSize = aView->boundingRect().size();
-          Vector2d bSize = bView->boundingRect().size();
-
-          if(std::abs(aSize[0] - bSize[0]) < mPrec)
-            aView->add(new ViewRelation(ViewRelation::PARALLEL,      aView, bView, ViewRelation::X));
-          if(std::abs(aSize[0] - bSize[1]) < mPrec)
-            aView->add(new ViewRelation(ViewRelation::PERPENDICULAR, aView, bView, ViewRelation::X));
-          if(std::abs(aSize[1] - bSize[1]) < mPrec)
-            aView->add(new ViewRelation(ViewRelation::PARALLEL,      aView, bView, ViewRelation::Y));
-          if(std::abs(aSize[1] - bSize[0]) < mPrec)
-            aView->add(new ViewRelation(ViewRelation::PERPENDICULAR, aView, bView, ViewRelation::Y));
+        if(sizeRelations[b] != 0) {
+          /* Determine whether the line segment that connects the centre points
+           * of a and b traverses the bounding boxes of any other nodes */
+          bool intersects = viewTree.intersects(Segment2d(aView->center(), bView->center()), a, b, mPrec);
+
+          /* TODO: continue if intersects? */
+
+          if(!intersects) {
+            if(sizeRelations[b] & PARALLEL_X)
+              aView->add(new ViewRelation(ViewRelation::PARALLEL,      aView, bView, ViewRelation::X));
+            if(sizeRelations[b] & PERPENDICULAR_X)
+              aView->add(new ViewRelation(ViewRelation::PERPENDICULAR, aView, bView, ViewRelation::X));
+            if(sizeRelations[b] & PARALLEL_Y)
+              aView->add(new ViewRelation(ViewRelation::PARALLEL,      aView, bView, ViewRelation::Y));
+            if(sizeRelations[b] & PERPENDICULAR_Y)
+              aView->add(new ViewRelation(ViewRelation::PERPENDICULAR, aView, bView, ViewRelation::Y));
+          }
         }
 
         /* Searching for name correspondence. */
         if(bView->type() == View::SECTIONAL) {
-          foreach(CuttingChain* cuttingChain, aView->cuttingChains()) {
-            if(bView->name() == cuttingChain->name()) {
-              assert(bView->type() == View::SECTIONAL);
+          QHash<QString, QList<CuttingChain*> >::const_iterator pos = cuttingChains.find(bView->name());
+          if(pos != cuttingChains.end()) {
+            foreach(CuttingChain* cuttingChain, *pos) {
               bView->setSourceCuttingChain(cuttingChain);
 
               aView->add(new ViewRelation(ViewRelation::NAME, aView, bView, ViewRelation::directionOf(cuttingChain->edge(0)->asSegment().asLine().direction())));
@@ -56,23 +314,18 @@ namespace qr {
         }
 
         /* Search for center correspondence. */
-        bool centerFound = false;
-        foreach(Edge* segment, aView->edges(Edge::NORMAL)) {
-          if(segment->type() != Edge::ARC)
-            continue;
-          
-          const Edge::ArcData& arc = segment->asArc();
-          foreach(Edge* segment, bView->edges(Edge::CENTER)) {
-            if(segment->asSegment().asLine().contains(arc.center(), mPrec)) {
-              aView->add(new ViewRelation(ViewRelation::CENTER, aView, bView, ViewRelation::perpendicularDirection(ViewRelation::directionOf(segment->asSegment().asLine().direction()))));
-              centerFound = true;
-            }
-          }
-          if(centerFound)
+        const QList<Edge*>& centerLines = bView->edges(Edge::CENTER);
+        for(int i = 0; i < static_cast<int>(arcCenters[a].size()); i++) {
+          centerLineIndices[b]->find(arcCenters[a][i], found);
+          foreach(int lineIndex, found)
+            aView->add(new ViewRelation(ViewRelation::CENTER, aView, bView, ViewRelation::perpendicularDirection(ViewRelation::directionOf(centerLines[lineIndex]->asSegment().asLine().direction()))));
+          if(!found.empty())
             break;
         }
       }
     }
+
+    qDeleteAll(centerLineIndices);
   }
 
 } // namespace qr
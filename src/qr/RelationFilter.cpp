@@ -1,24 +1,21 @@
 #include "RelationFilter.h"
-#include <set>
 #include <vector>
 #include <limits>
 #include <functional> /* for std::greater */
 #include <utility> /* for std::pair */
-#include <algorithm> /* for std::swap, std::sort */
-#include <QSet>
+#include <algorithm> /* for std::swap, std::sort, std::min */
+#include <QHash>
 #include "EvidenceSet.h"
 
 namespace qr {
   namespace {
-    typedef std::set<std::pair<View*, View*> > container_type;
-    typedef EvidenceSet<std::pair<View*, View*>> evidence_set_type;
+    /** @returns                       Index of an unordered pair of distinct elements of {0, ..., count - 1}. */
+    int pairIndex(int a, int b, int count) {
+      assert(a != b);
 
-    static container_type singletonSet(View* a, View* b) {
-      assert(a->id() < b->id());
-
-      container_type result;
-      result.insert(std::make_pair(a, b));
-      return result;
+      if(a > b)
+        std::swap(a, b);
+      return a * count - a * (a + 1) / 2 + (b - a - 1);
     }
 
   } // namespace
@@ -29,23 +26,22 @@ namespace qr {
 // RelationFilter
 // -------------------------------------------------------------------------- //
   void RelationFilter::operator() () {
-    container_type everything;
-    foreach(View* aView, mViews)
-      foreach(View* bView, mViews)
-        if(aView->id() < bView->id())
-          everything.insert(std::make_pair(aView, bView));
+    /* Frame of discernment is the set of all unordered view pairs. */
+    int viewCount = mViews.size();
+    int pairCount = viewCount * (viewCount - 1) / 2;
+    if(pairCount == 0)
+      return;
 
-    evidence_set_type evidenceSet;
-    evidenceSet.addEvidence(everything, 1);
+    QHash<View*, int> viewIndices;
+    for(int i = 0; i < viewCount; i++)
+      viewIndices[mViews[i]] = i;
 
+    EvidenceSet evidenceSet(pairCount);
+    evidenceSet.addEvidence(ElementSet::everything(pairCount), 1);
+
+    QList<EvidenceSet::SimpleSupport> supports;
     foreach(View* view, mViews) {
       foreach(ViewRelation* relation, view->relations()) {
-        View* aView = view;
-        View* bView = relation->target();
-
-        if(aView->id() >= bView->id())
-          std::swap(aView, bView);
-
         double belief;
         if(relation->type() == ViewRelation::PARALLEL || relation->type() == ViewRelation::PERPENDICULAR || relation->type() == ViewRelation::CENTER) {
           belief = 0.3;
@@ -55,52 +51,53 @@ namespace qr {
         }
         relation->setBelief(belief);
 
-        evidence_set_type newEvidenceSet;
-        container_type single = singletonSet(aView, bView);
-        if(single != everything) {
-          newEvidenceSet.addEvidence(everything, 1 - belief);
-          newEvidenceSet.addEvidence(single, belief);
-        } else {
-          newEvidenceSet.addEvidence(everything, 1);
-        }
-        evidenceSet.combine(newEvidenceSet);
+        int pair = pairIndex(viewIndices[view], viewIndices[relation->target()], viewCount);
+        supports.push_back(EvidenceSet::SimpleSupport(ElementSet::singleton(pairCount, pair), belief));
       }
     }
+    evidenceSet.combine(supports);
 
     std::vector<std::pair<double, std::pair<View*, View*> > > beliefs;
     foreach(View* aView, mViews)
       foreach(View* bView, mViews)
         if(aView->id() < bView->id())
-          beliefs.push_back(std::make_pair(evidenceSet.evidence(singletonSet(aView, bView)), std::make_pair(aView, bView)));
+          beliefs.push_back(std::make_pair(evidenceSet.evidence(ElementSet::singleton(pairCount, pairIndex(viewIndices[aView], viewIndices[bView], viewCount))), std::make_pair(aView, bView)));
     std::sort(beliefs.begin(), beliefs.end(), std::greater<std::pair<double, std::pair<View*, View*> > >());
 
-    QSet<View*> nodes;
-    std::set<std::pair<View*, View*> > edges;
-    std::pair<View*, View*> maxBeliefEdge = beliefs[0].second;
-    double maxBelief = beliefs[0].first;
-    while(true) {
-      nodes.insert(maxBeliefEdge.first);
-      nodes.insert(maxBeliefEdge.second);
-      edges.insert(maxBeliefEdge);
-      maxBeliefEdge.first->addAdjacentView(maxBeliefEdge.second/*, maxBelief*/);
-      maxBeliefEdge.second->addAdjacentView(maxBeliefEdge.first/*, maxBelief*/);
-
-      if(nodes.size() == mViews.size())
-        break;
-
-      maxBelief = -std::numeric_limits<double>::max();
-      for(unsigned i = 0; i < beliefs.size(); i++) {
-        View* aView = beliefs[i].second.first;
-        View* bView = beliefs[i].second.second;
-        if((nodes.contains(aView) && nodes.contains(bView)) || (!nodes.contains(aView) && !nodes.contains(bView)))
+    /* Grow the maximum spanning tree with Prim's algorithm. Edges are compared
+     * by their position in the sorted beliefs vector, so that ties are broken
+     * exactly as in the sorting. The graph is complete, so picking the best
+     * edge by a linear scan over the nodes is O(V^2) in total. */
+    std::vector<int> ranks(pairCount);
+    for(unsigned i = 0; i < beliefs.size(); i++)
+      ranks[pairIndex(viewIndices[beliefs[i].second.first], viewIndices[beliefs[i].second.second], viewCount)] = static_cast<int>(i);
+
+    std::vector<bool> inTree(viewCount, false), inEdges(pairCount, false);
+    std::vector<int> bestRanks(viewCount, std::numeric_limits<int>::max());
+    int rank = 0;
+    while(rank != std::numeric_limits<int>::max()) {
+      View* aView = beliefs[rank].second.first;
+      View* bView = beliefs[rank].second.second;
+      aView->addAdjacentView(bView/*, beliefs[rank].first*/);
+      bView->addAdjacentView(aView/*, beliefs[rank].first*/);
+      inEdges[pairIndex(viewIndices[aView], viewIndices[bView], viewCount)] = true;
+
+      /* Add new nodes to the tree & update best ranks of the nodes outside. */
+      for(int k = 0; k < 2; k++) {
+        int a = viewIndices[k == 0 ? aView : bView];
+        if(inTree[a])
           continue;
+        inTree[a] = true;
 
-        double belief = beliefs[i].first;
-        if(belief > maxBelief) {
-          maxBelief = belief;
-          maxBeliefEdge = beliefs[i].second;
-        }
+        for(int b = 0; b < viewCount; b++)
+          if(!inTree[b])
+            bestRanks[b] = std::min(bestRanks[b], ranks[pairIndex(a, b, viewCount)]);
       }
+
+      rank = std::numeric_limits<int>::max();
+      for(int b = 0; b < viewCount; b++)
+        if(!inTree[b])
+          rank = std::min(rank, bestRanks[b]);
     }
 
     foreach(View* view, mViews) {
@@ -109,10 +106,7 @@ namespace qr {
         View* aView = view;
         View* bView = relation->target();
 
-        if(aView->id() >= bView->id())
-          std::swap(aView, bView);
-
-        if(edges.find(std::make_pair(aView, bView)) == edges.end())
+        if(!inEdges[pairIndex(viewIndices[aView], viewIndices[bView], viewCount)])
           droppedRelations.push_back(relation);
       }
       foreach(ViewRelation* relation, droppedRelations)
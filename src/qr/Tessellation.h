@@ -0,0 +1,118 @@
+#ifndef __QR_TESSELLATION_H__
+#define __QR_TESSELLATION_H__
+
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm> /* for std::max(), std::min() */
+#include <Eigen/StdVector>
+#include "Edge.h"
+
+namespace qr {
+// -------------------------------------------------------------------------- //
+// Tessellation
+// -------------------------------------------------------------------------- //
+  /**
+   * Tessellation policy shared by all generators of curved geometry.
+   *
+   * A circle is split into the smallest number of segments that keeps the
+   * chord error within the tolerance, rounded up to a multiple of 4. Its
+   * points lie at angles 2 * pi * k / n counted from the x axis, and arcs of
+   * a circle only add their endpoints to these. So the same circle or arc
+   * always yields the same vertices, and so do arcs of the same circle where
+   * they overlap. */
+  class Tessellation {
+  public:
+    typedef std::vector<Vector2d, Eigen::aligned_allocator<Vector2d> > PointVector;
+
+    enum {
+      MIN_SEGMENTS = 8,
+      MAX_SEGMENTS = 256
+    };
+
+    /** Chord error tolerance relative to the part size. */
+    static double relativeTolerance() {
+      return 1.0e-3;
+    }
+
+    Tessellation(double tolerance): mTolerance(tolerance) {
+      assert(tolerance > 0);
+    }
+
+    /** @returns                       Tessellation for a part with the given bounding box. */
+    static Tessellation forPart(const Rect3d& boundingRect) {
+      double size = std::max(boundingRect.size(0), std::max(boundingRect.size(1), boundingRect.size(2)));
+      return Tessellation(std::max(size * relativeTolerance(), 1.0e-6)); /* TODO: EPS */
+    }
+
+    double tolerance() const {
+      return mTolerance;
+    }
+
+    /** @returns                       Number of segments for a full circle of the given radius. */
+    int segmentCount(double radius) const {
+      int result = MAX_SEGMENTS;
+      if(radius <= mTolerance) {
+        result = MIN_SEGMENTS;
+      } else {
+        /* Chord error of a segment spanning angle a is r * (1 - cos(a / 2)). */
+        double maxAngle = 2 * std::acos(1 - mTolerance / radius);
+        if(maxAngle * MAX_SEGMENTS > 2 * M_PI)
+          result = static_cast<int>(std::ceil(2 * M_PI / maxAngle));
+      }
+      result = (result + 3) / 4 * 4;
+      return std::min(std::max(result, static_cast<int>(MIN_SEGMENTS)), static_cast<int>(MAX_SEGMENTS));
+    }
+
+    /**
+     * Appends points of the given arc to the output, from start to end, both
+     * included.
+     *
+     * Elliptic arcs are split evenly, since there is no common grid to align
+     * them to. */
+    void arcPoints(const Edge::ArcData& arc, PointVector& output) const {
+      double longRadius = arc.longAxis().norm();
+      double shortRadius = arc.shortAxis().norm();
+      int n = segmentCount(longRadius);
+
+      if(std::abs(longRadius - shortRadius) > 1.0e-6 * longRadius) { /* TODO: EPS */
+        int count = std::max(1, static_cast<int>(std::ceil(n * arc.spanAngle() / (2 * M_PI))));
+        std::size_t offset = output.size();
+        output.resize(offset + count + 1);
+        arc.points(count, &output[offset]);
+        return;
+      }
+
+      Vector2d start = arc.point(0.0), end = arc.point(1.0);
+      double step = 2 * M_PI / n;
+      double minGap = 0.01 * step; /* Don't produce slivers near the endpoints. */
+
+      /* Direction of the arc in view coordinates. */
+      bool counterclockwise = arc.longAxis().x() * arc.shortAxis().y() - arc.longAxis().y() * arc.shortAxis().x() > 0;
+      double startAngle = std::atan2(start.y() - arc.center().y(), start.x() - arc.center().x());
+      int direction = counterclockwise ? 1 : -1;
+      int k = counterclockwise ? static_cast<int>(std::floor(startAngle / step)) + 1 : static_cast<int>(std::ceil(startAngle / step)) - 1;
+
+      output.push_back(start);
+      for(;; k += direction) {
+        double delta = direction * (k * step - startAngle);
+        if(delta > arc.spanAngle() - minGap)
+          break;
+        if(delta < minGap)
+          continue;
+
+        /* Same k modulo n must give the very same point. */
+        int index = ((k % n) + n) % n;
+        output.push_back(arc.center() + longRadius * Vector2d(std::cos(index * step), std::sin(index * step)));
+      }
+      output.push_back(end);
+    }
+
+  private:
+    double mTolerance;
+  };
+
+} // namespace qr
+
+#endif // __QR_TESSELLATION_H__
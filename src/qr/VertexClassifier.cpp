@@ -1,26 +1,29 @@
 #include "VertexClassifier.h"
+#include "Parallel.h"
 
 namespace qr {
 
   void VertexClassifier::operator() () {
-    foreach(View* view, mViews) {
-      foreach(Vertex* vertex, view->vertices()) {
-        bool hasCuttingEdges = false;
-        bool hasOtherEdges = false;
-        foreach(Edge* edge, vertex->edges()) {
-          if(edge->role() == Edge::CUTTING)
-            hasCuttingEdges = true;
-          else 
-            hasOtherEdges = true;
-        }
-
-        /* TODO: split vertices in case there are not only cutting edges. */
-        if(hasCuttingEdges)
-          assert(!hasOtherEdges);
+    parallelForEach(mViews, this, &VertexClassifier::classify);
+  }
 
-        if(hasCuttingEdges)
-          vertex->setType(Vertex::VIRTUAL);
+  void VertexClassifier::classify(View* view) const {
+    foreach(Vertex* vertex, view->vertices()) {
+      bool hasCuttingEdges = false;
+      bool hasOtherEdges = false;
+      foreach(Edge* edge, vertex->edges()) {
+        if(edge->role() == Edge::CUTTING)
+          hasCuttingEdges = true;
+        else 
+          hasOtherEdges = true;
       }
+
+      /* TODO: split vertices in case there are not only cutting edges. */
+      if(hasCuttingEdges)
+        assert(!hasOtherEdges);
+
+      if(hasCuttingEdges)
+        vertex->setType(Vertex::VIRTUAL);
     }
   }
 
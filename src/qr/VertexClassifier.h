@@ -16,6 +16,8 @@ namespace qr {
     void operator() ();
 
   private:
+    void classify(View* view) const;
+
     QList<View*> mViews;
   };
 
@@ -13,6 +13,7 @@
 #include "CuttingChain.h"
 #include "Vertex.h"
 #include "Loop.h"
+#include "LoopTable.h"
 
 namespace qr {
   class ViewBox;
@@ -87,6 +88,7 @@ namespace qr {
 
     void add(Loop* loop) {
       assert(!mLoops.contains(loop));
+      assert(!loop->isFrozen());
 
       mLoops.push_back(loop);
       loop->setView(this);
@@ -167,6 +169,15 @@ namespace qr {
       return mLoops;
     }
 
+    /** Freezes loops of this view into the loop table. Vertex 3d positions must be known at this point. */
+    void freezeLoops() {
+      mLoopTable.build(mLoops, mAllEdges, mVertices);
+    }
+
+    const LoopTable& loopTable() const {
+      return mLoopTable;
+    }
+
     Loop* outerLoop() const {
       return mOuterLoop;
     }
@@ -316,6 +327,7 @@ namespace qr {
     QList<Label*> mLabels;
     QList<Hatch*> mHatches;
     QList<Loop*> mLoops;
+    LoopTable mLoopTable;
     Loop* mOuterLoop;
     QList<ViewRelation*> mRelations;
     int mId;
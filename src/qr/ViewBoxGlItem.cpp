@@ -1,6 +1,7 @@
 #include "ViewBoxGlItem.h"
 #include <QGLWidget>
 #include "GPlane.h"
+#include "Tessellation.h"
 
 namespace qr {
   namespace {
@@ -12,7 +13,7 @@ namespace qr {
       return Vector3d(v.x(), v.y(), 0.0);
     }
 
-    void drawSegment(View* view, Edge* segment, const QColor& color, const Plane3d& plane) {
+    void drawSegment(View* view, Edge* segment, const QColor& color, const Plane3d& plane, const Tessellation& tessellation) {
       glColor3d(color.red() / 255.0, color.green() / 255.0, color.blue() / 255.0);
 
       switch(segment->style()) {
@@ -33,10 +34,11 @@ namespace qr {
         glVertex(plane.project(view->transform() * to3d(segment->end(1))));
       } else {
         assert(segment->type() == Edge::ARC);
-        const Edge::ArcData& arc = segment->asArc();
-        for(int i = 0; i < 10; i++) {
-          glVertex(plane.project(view->transform() * to3d(arc.point(i / 10.0))));
-          glVertex(plane.project(view->transform() * to3d(arc.point((i + 1) / 10.0))));
+        Tessellation::PointVector points;
+        tessellation.arcPoints(segment->asArc(), points);
+        for(int i = 0; i + 1 < static_cast<int>(points.size()); i++) {
+          glVertex(plane.project(view->transform() * to3d(points[i])));
+          glVertex(plane.project(view->transform() * to3d(points[i + 1])));
         }
       }
       glEnd();
@@ -47,6 +49,7 @@ namespace qr {
   void ViewBoxGlItem::draw() {
     glPushMatrix();
     Rect3d boundingRect = mViewBox->boundingRect();
+    Tessellation tessellation = Tessellation::forPart(boundingRect);
     glTranslated(-boundingRect.size(0) / 2, -boundingRect.size(1) / 2, -boundingRect.size(2) / 2);
 
     glEnable(GL_LINE_STIPPLE);
@@ -54,13 +57,13 @@ namespace qr {
     foreach(View* view, mViewBox->views()) {
       Plane3d viewPlane = Plane3d(view->transform() * Vector3d(0, 0, 0), view->transform().linear() * Vector3d(0, 0, 1));
       foreach(Edge* segment, view->edges())
-        drawSegment(view, segment, segment->color(), viewPlane);
+        drawSegment(view, segment, segment->color(), viewPlane, tessellation);
 
       if(view->type() == View::SECTIONAL) { /* TODO */
         Plane3d cuttingPlane = Plane3d(view->sourceCuttingChain()->view()->transform() * to3d(view->sourceCuttingChain()->edge(0)->end(0)), view->transform().linear() * Vector3d(0, 0, 1));
         foreach(Hatch* hatch, view->hatches()) {
           foreach(Edge* segment, hatch->segments()) {
-            drawSegment(view, segment, hatch->brush().color(), cuttingPlane);
+            drawSegment(view, segment, hatch->brush().color(), cuttingPlane, tessellation);
           }
         }
       }
@@ -1,7 +1,16 @@
 #include "ViewConstructor.h"
 #include <algorithm>
 #include <limits>
+#include <vector>
+#include <cmath>
+#include <Eigen/StdVector>
+#include <QPair>
+#include <QHash>
+#include <QMap>
+#include <QVector>
 #include "GRect.h"
+#include "KdTree.h"
+#include "Parallel.h"
 
 namespace qr {
   namespace detail {
@@ -11,6 +20,339 @@ namespace qr {
       QSet<Edge*> edges;
       Rect2d boundingRect;
     };
+
+    typedef std::vector<Vector2d, Eigen::aligned_allocator<Vector2d> > PointVector;
+
+    class ClosestViewQuery {
+    public:
+      ClosestViewQuery(const KdTree<View*>& viewTree, const PointVector& points, std::vector<View*>& views): mViewTree(viewTree), mPoints(points), mViews(views) {}
+
+      void operator() (int index) const {
+        mViews[index] = mViewTree.nearest(mPoints[index]);
+      }
+
+    private:
+      const KdTree<View*>& mViewTree;
+      const PointVector& mPoints;
+      std::vector<View*>& mViews;
+    };
+
+    /**
+     * Index of cutting edges by their supporting lines.
+     *
+     * Edges are split into classes by length, each class twice as long as the
+     * previous one. Within a class, edges are bucketed by direction angle and
+     * by offset from the center of all indexed edges, and each bucket is kept
+     * sorted by the projection of edge centers onto the bucket's direction.
+     *
+     * Tolerances of GLine::isCoincident() follow from the length of the query
+     * edge and the length of the shortest edge of a class, so only the buckets
+     * within these tolerances are probed. In a bucket, the distance between
+     * projections bounds the distance between centers from below, so the walk
+     * goes outwards from the query edge and stops as soon as it can't find a
+     * closer edge. Taken edges are removed from their buckets. Edges shorter
+     * than the precision are not bucketed and are always checked.
+     *
+     * Candidates are confirmed with isCoincident() against the query edge, so
+     * the results are the same as for a full scan. */
+    class CuttingLineIndex {
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+      CuttingLineIndex(const QList<Edge*>& edges, double prec): mEdges(edges), mTaken(edges.size(), false), mClassIds(edges.size(), -1), mKeys(edges.size()), mPositions(edges.size(), 0.0), mPrec(prec), mRadius(0.0) {
+        Rect2d rect;
+        for(int i = 0; i < edges.size(); i++) {
+          mIndices[edges[i]] = i;
+          rect.extend(edges[i]->end(0));
+          rect.extend(edges[i]->end(1));
+        }
+        if(edges.empty())
+          return;
+
+        mCenter = rect.center();
+        mRadius = 0.5 * rect.size().norm();
+
+        for(int i = 0; i < edges.size(); i++) {
+          double length = this->length(edges[i]);
+          if(length < prec) {
+            mOtherEdges.push_back(i);
+            continue;
+          }
+
+          mClassIds[i] = static_cast<int>(std::floor(std::log(length / prec) / std::log(2.0)));
+          LengthClass& lengthClass = this->lengthClass(mClassIds[i]);
+          lengthClass.minLength = std::min(lengthClass.minLength, length);
+
+          double angle, offset;
+          locate(edges[i], angle, offset);
+          qint64 angleKey = static_cast<qint64>(std::floor(angle / lengthClass.angleStep));
+          if(wrap(lengthClass, angleKey))
+            offset = -offset;
+          mKeys[i] = Key(angleKey, static_cast<qint64>(std::floor(offset / lengthClass.offsetStep)));
+          mPositions[i] = axis(lengthClass, angleKey).dot(center(edges[i]));
+          lengthClass.buckets[mKeys[i]].push_back(i);
+        }
+
+        for(QMap<int, LengthClass>::iterator pos = mClasses.begin(); pos != mClasses.end(); ++pos)
+          for(QHash<Key, QVector<int> >::iterator bucket = pos->buckets.begin(); bucket != pos->buckets.end(); ++bucket)
+            std::sort(bucket->begin(), bucket->end(), PositionLess(mPositions));
+      }
+
+      bool isTaken(Edge* edge) const {
+        QHash<Edge*, int>::const_iterator pos = mIndices.find(edge);
+        return pos != mIndices.end() && mTaken[*pos];
+      }
+
+      void take(Edge* edge) {
+        QHash<Edge*, int>::const_iterator pos = mIndices.find(edge);
+        if(pos == mIndices.end() || mTaken[*pos])
+          return;
+
+        int index = *pos;
+        mTaken[index] = true;
+        if(mClassIds[index] == -1)
+          return;
+
+        QHash<Key, QVector<int> >& buckets = mClasses[mClassIds[index]].buckets;
+        QHash<Key, QVector<int> >::iterator bucket = buckets.find(mKeys[index]);
+        bucket->erase(std::lower_bound(bucket->begin(), bucket->end(), index, PositionLess(mPositions)));
+        if(bucket->empty())
+          buckets.erase(bucket);
+      }
+
+      /**
+       * Takes the edge coincident with the given one that has its center
+       * closest to the center of the given edge. Ties go to the edge that
+       * comes first in the index.
+       *
+       * @returns                      Taken edge, or NULL if there are no such edges left. */
+      Edge* takeClosest(Edge* edge) {
+        Query query;
+        query.edge = edge;
+        query.line = edge->asSegment().asLine();
+        query.center = center(edge);
+        query.length = length(edge);
+        locate(edge, query.angle, query.offset);
+        query.result = -1;
+        query.minSquaredNorm = std::numeric_limits<double>::max();
+
+        if(query.length < mPrec) {
+          for(int i = 0; i < mEdges.size(); i++)
+            check(i, query);
+        } else {
+          foreach(int i, mOtherEdges)
+            check(i, query);
+          for(QMap<int, LengthClass>::const_iterator pos = mClasses.begin(); pos != mClasses.end(); ++pos)
+            probe(*pos, query);
+        }
+        if(query.result == -1)
+          return NULL;
+
+        take(mEdges[query.result]);
+        return mEdges[query.result];
+      }
+
+    private:
+      typedef QPair<qint64, qint64> Key;
+
+      struct LengthClass {
+        double minLength, angleStep, offsetStep;
+        qint64 angleBuckets;
+        QHash<Key, QVector<int> > buckets;
+      };
+
+      struct Query {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+        Edge* edge;
+        Line2d line;
+        Vector2d center;
+        double length, angle, offset;
+        int result;
+        double minSquaredNorm;
+      };
+
+      /** Orders bucket entries by projection, then by index. */
+      class PositionLess {
+      public:
+        PositionLess(const std::vector<double>& positions): mPositions(positions) {}
+
+        bool operator() (int a, int b) const {
+          return mPositions[a] < mPositions[b] || (mPositions[a] == mPositions[b] && a < b);
+        }
+
+        bool operator() (int a, double position) const {
+          return mPositions[a] < position;
+        }
+
+        bool operator() (double position, int b) const {
+          return position < mPositions[b];
+        }
+
+      private:
+        const std::vector<double>& mPositions;
+      };
+
+      static double length(Edge* edge) {
+        return (edge->end(1) - edge->end(0)).norm();
+      }
+
+      static Vector2d center(Edge* edge) {
+        return edge->boundingRect().center();
+      }
+
+      /** @returns                     Unit direction of the edge, pointing into the upper half-plane. */
+      static Vector2d direction(Edge* edge) {
+        Vector2d result = (edge->end(1) - edge->end(0)).normalized();
+        if(result.y() < 0 || (result.y() == 0 && result.x() < 0))
+          result = -result;
+        return result;
+      }
+
+      /** @returns                     Unit direction of the given bucket. */
+      static Vector2d axis(const LengthClass& lengthClass, qint64 angleKey) {
+        double angle = (angleKey + 0.5) * lengthClass.angleStep;
+        return Vector2d(std::cos(angle), std::sin(angle));
+      }
+
+      /**
+       * Brings the angle key into range.
+       *
+       * @returns                      True if the direction got flipped, and so did the offset. */
+      static bool wrap(const LengthClass& lengthClass, qint64& angleKey) {
+        bool isFlipped = false;
+        while(angleKey < 0) {
+          angleKey += lengthClass.angleBuckets;
+          isFlipped = !isFlipped;
+        }
+        while(angleKey >= lengthClass.angleBuckets) {
+          angleKey -= lengthClass.angleBuckets;
+          isFlipped = !isFlipped;
+        }
+        return isFlipped;
+      }
+
+      /** Computes direction angle of the edge and its offset from the center. */
+      void locate(Edge* edge, double& angle, double& offset) const {
+        Vector2d dir = direction(edge);
+        Vector2d origin = edge->end(0) - mCenter;
+        angle = std::atan2(dir.y(), dir.x());
+        offset = dir.x() * origin.y() - dir.y() * origin.x();
+      }
+
+      LengthClass& lengthClass(int classId) {
+        QMap<int, LengthClass>::iterator pos = mClasses.find(classId);
+        if(pos != mClasses.end())
+          return *pos;
+
+        /* Buckets are sized so that queries with edges of this class probe
+         * just a few of them, see probe(). */
+        double length = mPrec * std::pow(2.0, classId);
+        double angle = std::asin(std::min(1.0, mPrec / length));
+
+        LengthClass result;
+        result.minLength = std::numeric_limits<double>::max();
+        result.angleBuckets = static_cast<qint64>(std::max(1.0, std::floor(std::min(M_PI / (2 * angle), 1.0e9))));
+        result.angleStep = M_PI / result.angleBuckets; /* Must divide pi, so that buckets wrap around evenly. */
+        result.offsetStep = 2 * (mPrec * std::max(1.0, 2 * mRadius / length) + angle * mRadius) + mPrec;
+        return *mClasses.insert(classId, result);
+      }
+
+      /** Checks the given edge against the closest one found so far. */
+      void check(int index, Query& query) const {
+        if(mTaken[index] || mEdges[index] == query.edge || !query.line.isCoincident(mEdges[index]->asSegment().asLine(), mPrec))
+          return;
+
+        double squaredNorm = (query.center - center(mEdges[index])).squaredNorm();
+        if(squaredNorm < query.minSquaredNorm || (squaredNorm == query.minSquaredNorm && index < query.result)) {
+          query.minSquaredNorm = squaredNorm;
+          query.result = index;
+        }
+      }
+
+      void probe(const LengthClass& lengthClass, Query& query) const {
+        /* Coincident lines are parallel, so the angle between them is at most
+         * asin(prec / l), l being the length of the shorter edge. The origin of
+         * an edge lies within prec * max(1, d / l0) of the query line, d being
+         * the extent and l0 the length of the query edge. Both tolerances are
+         * widened to cover round-off. */
+        double angle = std::asin(std::min(1.0, mPrec / std::min(query.length, lengthClass.minLength)));
+        double offset = mPrec * std::max(1.0, 2 * mRadius / query.length) + angle * mRadius;
+        angle = 1.5 * angle;
+        offset = 1.5 * offset + mPrec;
+
+        qint64 angleKeyMin = static_cast<qint64>(std::floor(std::max(query.angle - angle, -M_PI) / lengthClass.angleStep));
+        qint64 angleKeyMax = static_cast<qint64>(std::floor(std::min(query.angle + angle, 2 * M_PI) / lengthClass.angleStep));
+        double offsetKeys = std::floor(2 * offset / lengthClass.offsetStep) + 2;
+
+        /* If there are more keys to probe than there are buckets, go through the buckets instead. */
+        if((angleKeyMax - angleKeyMin + 1) * offsetKeys > lengthClass.buckets.size()) {
+          for(QHash<Key, QVector<int> >::const_iterator pos = lengthClass.buckets.begin(); pos != lengthClass.buckets.end(); ++pos)
+            if(isProbed(lengthClass, pos.key(), angleKeyMin, angleKeyMax, query.offset, offset))
+              walk(lengthClass, pos.key().first, *pos, query);
+          return;
+        }
+
+        for(qint64 angleKey = angleKeyMin; angleKey <= angleKeyMax; angleKey++) {
+          qint64 wrappedAngleKey = angleKey;
+          double queryOffset = wrap(lengthClass, wrappedAngleKey) ? -query.offset : query.offset;
+          qint64 offsetKeyMin = static_cast<qint64>(std::floor((queryOffset - offset) / lengthClass.offsetStep));
+          qint64 offsetKeyMax = static_cast<qint64>(std::floor((queryOffset + offset) / lengthClass.offsetStep));
+
+          for(qint64 offsetKey = offsetKeyMin; offsetKey <= offsetKeyMax; offsetKey++) {
+            QHash<Key, QVector<int> >::const_iterator pos = lengthClass.buckets.find(Key(wrappedAngleKey, offsetKey));
+            if(pos != lengthClass.buckets.end())
+              walk(lengthClass, wrappedAngleKey, *pos, query);
+          }
+        }
+      }
+
+      /** @returns                     True if the given bucket is among the ones probed for the given key and offset ranges. */
+      static bool isProbed(const LengthClass& lengthClass, const Key& key, qint64 angleKeyMin, qint64 angleKeyMax, double queryOffset, double offset) {
+        /* Go through the unwrapped angle keys of the bucket that are in range. */
+        qint64 shift = angleKeyMin - key.first;
+        qint64 turns = shift >= 0 ? (shift + lengthClass.angleBuckets - 1) / lengthClass.angleBuckets : -(-shift / lengthClass.angleBuckets);
+        for(qint64 angleKey = key.first + turns * lengthClass.angleBuckets; angleKey <= angleKeyMax; angleKey += lengthClass.angleBuckets, turns++) {
+          double bucketOffset = turns % 2 != 0 ? -queryOffset : queryOffset;
+          if(static_cast<qint64>(std::floor((bucketOffset - offset) / lengthClass.offsetStep)) <= key.second && key.second <= static_cast<qint64>(std::floor((bucketOffset + offset) / lengthClass.offsetStep)))
+            return true;
+        }
+        return false;
+      }
+
+      /**
+       * Checks bucket entries outwards from the query edge while they can
+       * still be closer than the closest one. The bound is loosened by the
+       * precision, so that round-off in projections doesn't lose ties. */
+      void walk(const LengthClass& lengthClass, qint64 angleKey, const QVector<int>& bucket, Query& query) const {
+        double position = axis(lengthClass, angleKey).dot(query.center);
+        QVector<int>::const_iterator start = std::lower_bound(bucket.begin(), bucket.end(), position, PositionLess(mPositions));
+
+        for(QVector<int>::const_iterator pos = start; pos != bucket.end(); ++pos) {
+          if(mPositions[*pos] - position > std::sqrt(query.minSquaredNorm) + mPrec)
+            break;
+          check(*pos, query);
+        }
+
+        for(QVector<int>::const_iterator pos = start; pos != bucket.begin();) {
+          --pos;
+          if(position - mPositions[*pos] > std::sqrt(query.minSquaredNorm) + mPrec)
+            break;
+          check(*pos, query);
+        }
+      }
+
+      QList<Edge*> mEdges;
+      QHash<Edge*, int> mIndices;
+      std::vector<bool> mTaken;
+      std::vector<int> mClassIds;
+      std::vector<Key> mKeys;
+      std::vector<double> mPositions;
+      Vector2d mCenter;
+      double mPrec, mRadius;
+      QMap<int, LengthClass> mClasses;
+      QVector<int> mOtherEdges;
+    };
   }
 
 // -------------------------------------------------------------------------- //
@@ -95,21 +437,46 @@ namespace qr {
       mViews.push_back(view);
     }
 
-    /* Add other edges,... */
+    /* Index view centers. Only normal edges define view bounds, so the centers 
+     * do not change while the remaining primitives are distributed. */
+    KdTree<View*> viewTree;
+    foreach(View* view, mViews)
+      viewTree.add(view->center(), view);
+    viewTree.build();
+
+    /* Find closest views for all remaining primitives at once. */
+    QList<Edge*> otherEdges;
     foreach(Edge* edge, mDrawing->edges())
       if(edge->role() != Edge::NORMAL)
-        closestView(edge->boundingRect().center())->add(edge);
+        otherEdges.push_back(edge);
+
+    detail::PointVector points;
+    points.reserve(otherEdges.size() + mDrawing->hatches().size() + mDrawing->labels().size());
+    foreach(Edge* edge, otherEdges)
+      points.push_back(edge->boundingRect().center());
+    foreach(Hatch* hatch, mDrawing->hatches())
+      points.push_back(hatch->boundingRect().center());
+    foreach(Label* label, mDrawing->labels())
+      points.push_back(label->position());
+
+    std::vector<View*> closestViews(points.size());
+    parallelFor(static_cast<int>(points.size()), detail::ClosestViewQuery(viewTree, points, closestViews));
+    std::vector<View*>::const_iterator closest = closestViews.begin();
+
+    /* Add other edges,... */
+    foreach(Edge* edge, otherEdges)
+      (*closest++)->add(edge);
 
     /* ...hatches,... */
     foreach(Hatch* hatch, mDrawing->hatches()) {
-      View* view = closestView(hatch->boundingRect().center());
+      View* view = *closest++;
       view->add(hatch);
       view->setType(View::SECTIONAL);
     }
 
     /* ...and labels. */
     foreach(Label* label, mDrawing->labels()) {
-      View* view = closestView(label->position());
+      View* view = *closest++;
       view->add(label);
 
       QString text = label->text().trimmed();
@@ -117,107 +484,85 @@ namespace qr {
         view->setName(QString(text[0]));
     }
 
-    /* Trace cutting lines. */
-    foreach(View* view, mViews) {
-      QList<Edge*> edges = view->edges(Edge::CUTTING);
-      while(!edges.empty()) {
-        QList<Edge*> chain;
-        bool chainValid = false;
-        Edge* startEdge = NULL;
-        foreach(Edge* edge, edges) {
-          if(!view->boundingRect().contains(edge->asSegment(), mPrec)) {
-            startEdge = edge;
-            break;
-          }
-        }
-        if(startEdge == NULL)
-          break;
-        chain.push_back(startEdge);
-        edges.removeOne(startEdge);
-
-        while(true) {
-          Edge* endEdge = NULL;
-          double minSquaredNorm = std::numeric_limits<double>::max();
-          foreach(Edge* edge, edges) {
-            if(!startEdge->asSegment().asLine().isCoincident(edge->asSegment().asLine(), mPrec))
-              continue;
-
-            double squaredNorm = (startEdge->boundingRect().center() - edge->boundingRect().center()).squaredNorm();
-            if(squaredNorm < minSquaredNorm) {
-              minSquaredNorm = squaredNorm;
-              endEdge = edge;
-            }
-          }
-          if(endEdge == NULL)
-            break;
-          chain.push_back(endEdge);
-          edges.removeOne(endEdge);
-
-          if(!view->boundingRect().contains(endEdge->asSegment(), mPrec)) {
-            chainValid = true;
-            break;
-          }
+    /* Trace cutting lines. Views are independent here. */
+    parallelForEach(mViews, this, &ViewConstructor::traceCuttingChains);
 
-          if(endEdge->extensions().size() != 1)
-            break;
+    return mViews;
+  }
 
-          startEdge = endEdge->extensions().back(); /* TODO: check whether we correctly calculate extensions for central lines */
-          chain.push_back(startEdge);
-          edges.removeOne(startEdge);
+  void ViewConstructor::traceCuttingChains(View* view) const {
+    QList<Edge*> edges = view->edges(Edge::CUTTING);
+    detail::CuttingLineIndex lineIndex(edges, mPrec);
+
+    KdTree<Label*> labelTree;
+    foreach(Label* label, view->labels())
+      if(label->text().size() == 1)
+        labelTree.add(label->position(), label);
+    labelTree.build();
+
+    int next = 0;
+    while(true) {
+      QList<Edge*> chain;
+      bool chainValid = false;
+      Edge* startEdge = NULL;
+      for(; next < edges.size(); next++) {
+        Edge* edge = edges[next];
+        if(!lineIndex.isTaken(edge) && !view->boundingRect().contains(edge->asSegment(), mPrec)) {
+          startEdge = edge;
+          break;
         }
+      }
+      if(startEdge == NULL)
+        break;
+      chain.push_back(startEdge);
+      lineIndex.take(startEdge);
 
-        QString name;
-        double minSquaredNorm = std::numeric_limits<double>::max();
-        foreach(Label* label, view->labels()) {
-          if(label->text().size() != 1)
-            continue;
+      while(true) {
+        Edge* endEdge = lineIndex.takeClosest(startEdge);
+        if(endEdge == NULL)
+          break;
+        chain.push_back(endEdge);
 
-          double squaredNorm = (label->position() - chain[0]->boundingRect().center()).squaredNorm();
-          if(squaredNorm < minSquaredNorm) {
-            minSquaredNorm = squaredNorm;
-            name = label->text();
-          }
+        if(!view->boundingRect().contains(endEdge->asSegment(), mPrec)) {
+          chainValid = true;
+          break;
         }
-        if(name.isEmpty())
-          chainValid = false;
-
-        if(chainValid) {
-          assert(chain.size() == 2);
-          foreach(Edge* edge, chain)
-            view->remove(edge);
-
-          CuttingChain* cuttingChain = new CuttingChain(name);
-          for(int i = 0; i < chain.size(); i += 2) {
-            Edge* cuttingEdge = new Edge(
-              Edge::Line(), 
-              chain[i]->asSegment().farthestEnd(chain[i + 1]->boundingRect().center()),
-              chain[i + 1]->asSegment().farthestEnd(chain[i]->boundingRect().center()),
-              chain[i]->color(),
-              chain[i]->style()
-              );
-            cuttingEdge->setRole(Edge::CUTTING);
-            cuttingChain->addEdge(cuttingEdge);
-          }
 
-          view->add(cuttingChain);
-        }
+        if(endEdge->extensions().size() != 1)
+          break;
+
+        startEdge = endEdge->extensions().back(); /* TODO: check whether we correctly calculate extensions for central lines */
+        chain.push_back(startEdge);
+        lineIndex.take(startEdge);
       }
-    }
 
-    return mViews;
-  }
+      QString name;
+      if(!labelTree.isEmpty())
+        name = labelTree.nearest(chain[0]->boundingRect().center())->text();
+      if(name.isEmpty())
+        chainValid = false;
+
+      if(chainValid) {
+        assert(chain.size() == 2);
+        foreach(Edge* edge, chain)
+          view->remove(edge);
+
+        CuttingChain* cuttingChain = new CuttingChain(name);
+        for(int i = 0; i < chain.size(); i += 2) {
+          Edge* cuttingEdge = new Edge(
+            Edge::Line(), 
+            chain[i]->asSegment().farthestEnd(chain[i + 1]->boundingRect().center()),
+            chain[i + 1]->asSegment().farthestEnd(chain[i]->boundingRect().center()),
+            chain[i]->color(),
+            chain[i]->style()
+            );
+          cuttingEdge->setRole(Edge::CUTTING);
+          cuttingChain->addEdge(cuttingEdge);
+        }
 
-  View* ViewConstructor::closestView(const Vector2d& point) const {
-    double minSquaredNorm = std::numeric_limits<double>::max();
-    View* result = NULL;
-    foreach(View* view, mViews) {
-      double squaredNorm = (point - view->center()).squaredNorm();
-      if(squaredNorm < minSquaredNorm) {
-        minSquaredNorm = squaredNorm;
-        result = view;
+        view->add(cuttingChain);
       }
     }
-    return result;
   }
 
 
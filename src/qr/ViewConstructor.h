@@ -19,7 +19,7 @@ namespace qr {
     QList<View*> operator() ();
 
   private:
-    View* closestView(const Vector2d& point) const;
+    void traceCuttingChains(View* view) const;
 
     double mPrec;
     Drawing* mDrawing;